@@ -35,20 +35,23 @@
 #include <sys/ioctl.h>
 #include <termios.h>
 #include <fcntl.h>
-#include <glob.h>
+#include <pthread.h>
 #include <limits.h>
 #include <ctype.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+#  include <sys/sendfile.h>
+#  include <sys/syscall.h>
+#  include <sched.h>
+#endif
 
 /* environ is in unistd.h on most systems, but declare it explicitly for safety */
 #ifndef _GNU_SOURCE
 extern char **environ;
 #endif
 
-/* GLOB_TILDE is not in POSIX; guard against systems that lack it */
-#ifndef GLOB_TILDE
-#  define GLOB_TILDE 0
-#endif
-
 /* ===== ANSI Color Codes ===== */
 #define RESET       "\033[0m"
 #define BOLD        "\033[1m"
@@ -95,10 +98,8 @@ extern char **environ;
 /* ===== Constants ===== */
 #define XSH_VERSION     "1.0.0"
 #define XSH_NAME        "XSH"
-#define MAX_CMD_LEN     4096
-#define MAX_ARGS        256
 #define MAX_PATH        PATH_MAX
-#define MAX_HISTORY     1000
+#define MAX_HISTORY     100000  /* default entry limit; XSH_HISTSIZE overrides */
 #define XSH_HISTORY_FILE ".xsh_history"
 #define XSH_RC_FILE     ".xshrc"
 
@@ -108,6 +109,149 @@ static int running = 1;
 static char cwd[MAX_PATH];
 static char hostname[256];
 static struct passwd *user_info;
+static int rc_cacheable = 0;    /* cleared by anything an rc snapshot cannot replay */
+
+/* ===== Shell Variables ===== */
+/*
+ * Every shell variable lives in a hash table as one "NAME=value" string.
+ * Only exported variables reach child processes: their strings are
+ * gathered into a cached envp (also installed as environ) that is
+ * rebuilt only after an exported variable changes. Strings the current
+ * envp may still point to are kept until that rebuild.
+ */
+#define VAR_BUCKETS 256
+#define VAR_EXPORT  0x01
+
+typedef struct Var {
+    char *name;
+    char *str;              /* "NAME=value", or NULL if exported but never set */
+    size_t nlen;
+    int flags;
+    struct Var *next;
+} Var;
+
+static Var *var_table[VAR_BUCKETS];
+static char **var_env;          /* envp of the exported variables */
+static int var_env_dirty = 1;
+static char **var_stale;        /* old strings var_env may still reference */
+static int var_nstale = 0, var_stale_cap = 0;
+
+static unsigned int str_hash(const char *s) {
+    unsigned int h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static Var *var_new(const char *name) {
+    Var *v = calloc(1, sizeof(Var));
+    v->name = strdup(name);
+    v->nlen = strlen(name);
+    return v;
+}
+
+static Var **var_slot(const char *name) {
+    Var **pp = &var_table[str_hash(name) % VAR_BUCKETS];
+    while (*pp && strcmp((*pp)->name, name) != 0) pp = &(*pp)->next;
+    return pp;
+}
+
+const char *var_get(const char *name) {
+    Var *v = *var_slot(name);
+    return v && v->str ? v->str + v->nlen + 1 : NULL;
+}
+
+/* Drop v's string; if the envp may hold it, keep it alive until the rebuild */
+static void var_retire(Var *v) {
+    if (!v->str) return;
+    if (!(v->flags & VAR_EXPORT)) {
+        free(v->str);
+    } else {
+        if (var_nstale == var_stale_cap) {
+            var_stale_cap = var_stale_cap ? var_stale_cap * 2 : 16;
+            var_stale = realloc(var_stale, var_stale_cap * sizeof(char*));
+        }
+        var_stale[var_nstale++] = v->str;
+        var_env_dirty = 1;
+    }
+    v->str = NULL;
+}
+
+/* Set name=value; VAR_EXPORT in flags exports it, and an existing export is kept */
+void var_set(const char *name, const char *value, int flags) {
+    Var **pp = var_slot(name);
+    Var *v = *pp;
+    if (!v) {
+        v = *pp = var_new(name);
+    } else if (v->str && (v->flags | flags) == v->flags &&
+               strcmp(v->str + v->nlen + 1, value) == 0) {
+        return;
+    }
+    var_retire(v);
+    size_t vl = strlen(value);
+    v->str = malloc(v->nlen + vl + 2);
+    memcpy(v->str, v->name, v->nlen);
+    v->str[v->nlen] = '=';
+    memcpy(v->str + v->nlen + 1, value, vl + 1);
+    v->flags |= flags;
+    if (v->flags & VAR_EXPORT) var_env_dirty = 1;
+}
+
+/* `export NAME`: an unset name is exported once it gets a value */
+void var_export(const char *name) {
+    Var **pp = var_slot(name);
+    if (!*pp) *pp = var_new(name);
+    if (!((*pp)->flags & VAR_EXPORT)) {
+        (*pp)->flags |= VAR_EXPORT;
+        var_env_dirty = 1;
+    }
+}
+
+void var_unset(const char *name) {
+    Var **pp = var_slot(name);
+    Var *v = *pp;
+    if (!v) return;
+    *pp = v->next;
+    var_retire(v);
+    free(v->name);
+    free(v);
+}
+
+/* The environment for children: exported variables, rebuilt only when one changed */
+char **var_envp(void) {
+    if (!var_env_dirty) return var_env;
+    int n = 0;
+    for (int b = 0; b < VAR_BUCKETS; b++)
+        for (Var *v = var_table[b]; v; v = v->next)
+            if ((v->flags & VAR_EXPORT) && v->str) n++;
+    char **env = malloc((n + 1) * sizeof(char*));
+    n = 0;
+    for (int b = 0; b < VAR_BUCKETS; b++)
+        for (Var *v = var_table[b]; v; v = v->next)
+            if ((v->flags & VAR_EXPORT) && v->str) env[n++] = v->str;
+    env[n] = NULL;
+    environ = env;
+    free(var_env);
+    var_env = env;
+    for (int i = 0; i < var_nstale; i++) free(var_stale[i]);
+    var_nstale = 0;
+    var_env_dirty = 0;
+    return env;
+}
+
+/* Import the inherited environment; everything in it stays exported */
+static void var_init(void) {
+    for (char **e = environ; *e; e++) {
+        char *eq = strchr(*e, '=');
+        if (!eq || eq == *e) continue;
+        char *name = strndup(*e, eq - *e);
+        var_set(name, eq + 1, VAR_EXPORT);
+        free(name);
+    }
+    var_envp();
+}
 
 /* ===== ASCII Art Banner ===== */
 void print_banner(void) {
@@ -188,14 +332,125 @@ void print_banner(void) {
     }
 }
 
+/* ===== Git Branch Detection ===== */
+/*
+ * Finds the current branch without spawning git: walk up from cwd to the
+ * .git directory (or gitdir file) and parse HEAD. The result is cached by
+ * directory and by HEAD's identity, so a prompt redraw in the same repo
+ * costs a single stat().
+ */
+static struct {
+    char dir[MAX_PATH];     /* cwd the cache entry belongs to */
+    char head[MAX_PATH + 8];    /* path to HEAD, or the .git probe path when not in a repo */
+    int in_repo;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    char branch[64];
+} git_cache;
+
+/* Locate the git dir for `dir`; fills gitdir and returns 1 if found */
+static int git_find_dir(const char *dir, char *gitdir, size_t sz) {
+    char d[MAX_PATH];
+    strncpy(d, dir, sizeof(d) - 1);
+    d[sizeof(d) - 1] = '\0';
+
+    while (1) {
+        char probe[MAX_PATH + 8];
+        struct stat st;
+        snprintf(probe, sizeof(probe), "%s/.git", strcmp(d, "/") == 0 ? "" : d);
+        if (stat(probe, &st) == 0) {
+            /* A path that does not fit counts as not found */
+            if (S_ISDIR(st.st_mode)) return (size_t)snprintf(gitdir, sz, "%s", probe) < sz;
+            /* Worktrees and submodules: .git is a file "gitdir: <path>" */
+            FILE *f = fopen(probe, "r");
+            if (f) {
+                char line[MAX_PATH];
+                int ok = fgets(line, sizeof(line), f) && strncmp(line, "gitdir: ", 8) == 0;
+                fclose(f);
+                if (ok) {
+                    char *target = line + 8;
+                    target[strcspn(target, "\r\n")] = '\0';
+                    int n = target[0] == '/' ? snprintf(gitdir, sz, "%s", target) :
+                            snprintf(gitdir, sz, "%s/%s", strcmp(d, "/") == 0 ? "" : d, target);
+                    return n >= 0 && (size_t)n < sz;
+                }
+            }
+        }
+        char *slash = strrchr(d, '/');
+        if (!slash || slash == d) {
+            if (strcmp(d, "/") == 0) return 0;
+            strcpy(d, "/");
+        } else {
+            *slash = '\0';
+        }
+    }
+}
+
+/* Parse HEAD into a branch name the way `git rev-parse --abbrev-ref` shows it */
+static void git_read_head(const char *head_path, char *branch, size_t sz) {
+    branch[0] = '\0';
+    int fd = open(head_path, O_RDONLY);
+    if (fd < 0) return;
+    char buf[256];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return;
+    buf[n] = '\0';
+    buf[strcspn(buf, "\r\n")] = '\0';
+
+    if (strncmp(buf, "ref: ", 5) == 0) {
+        const char *ref = buf + 5;
+        if (strncmp(ref, "refs/heads/", 11) == 0) ref += 11;
+        else if (strncmp(ref, "refs/", 5) == 0) ref += 5;
+        snprintf(branch, sz, "%.63s", ref);
+    } else {
+        /* Detached HEAD */
+        snprintf(branch, sz, "HEAD");
+    }
+}
+
+static const char *git_current_branch(const char *dir) {
+    struct stat st;
+    if (strcmp(git_cache.dir, dir) == 0 && git_cache.head[0]) {
+        int found = stat(git_cache.head, &st) == 0;
+        if (!git_cache.in_repo && !found)
+            return git_cache.branch;
+        if (git_cache.in_repo && found && st.st_ino == git_cache.ino &&
+            st.st_size == git_cache.size && st.st_mtime == git_cache.mtime)
+            return git_cache.branch;
+    }
+
+    snprintf(git_cache.dir, sizeof(git_cache.dir), "%s", dir);
+    git_cache.branch[0] = '\0';
+
+    char gitdir[MAX_PATH];
+    if (!git_find_dir(dir, gitdir, sizeof(gitdir))) {
+        /* Remember the nearest probe so `git init` here is noticed */
+        git_cache.in_repo = 0;
+        snprintf(git_cache.head, sizeof(git_cache.head), "%s/.git",
+                 strcmp(dir, "/") == 0 ? "" : dir);
+        return git_cache.branch;
+    }
+
+    git_cache.in_repo = 1;
+    snprintf(git_cache.head, sizeof(git_cache.head), "%s/HEAD", gitdir);
+    if (stat(git_cache.head, &st) == 0) {
+        git_cache.ino = st.st_ino;
+        git_cache.size = st.st_size;
+        git_cache.mtime = st.st_mtime;
+    }
+    git_read_head(git_cache.head, git_cache.branch, sizeof(git_cache.branch));
+    return git_cache.branch;
+}
+
 /* ===== Prompt Generation ===== */
 char *build_prompt(void) {
     static char prompt[1024];
     char short_cwd[256];
-    char *home = getenv("HOME");
+    const char *home = var_get("HOME");
 
-    /* Get CWD */
-    getcwd(cwd, sizeof(cwd));
+    /* cwd is kept current by main() and builtin_cd() */
 
     /* Shorten home to ~ */
     if (home && strncmp(cwd, home, strlen(home)) == 0) {
@@ -216,14 +471,7 @@ char *build_prompt(void) {
     }
 
     /* Get git branch if available */
-    char git_branch[64] = "";
-    FILE *fp = popen("git rev-parse --abbrev-ref HEAD 2>/dev/null", "r");
-    if (fp) {
-        if (fgets(git_branch, sizeof(git_branch), fp)) {
-            git_branch[strcspn(git_branch, "\n")] = '\0';
-        }
-        pclose(fp);
-    }
+    const char *git_branch = git_current_branch(cwd);
 
     /* Build prompt segments */
     char git_seg[128] = "";
@@ -293,1070 +541,4702 @@ snprintf(prompt, sizeof(prompt),
 return prompt;
 }
 /* ===== Signal Handlers ===== */
+/* Set on Ctrl-C at the prompt or while a loop is running in the shell */
+static volatile sig_atomic_t sigint_pending;
+
 void sigint_handler(int sig) {
     (void)sig;
-    /* signal handled in readline loop */
+    /* signal handled in readline loop; loops poll the flag */
+    sigint_pending = 1;
 }
 
-void sigchld_handler(int sig) {
+/*
+ * Reap finished background jobs only. Foreground children are collected
+ * by whoever launched them; reaping them here would steal their status.
+ */
+void sigchld_handler(int sig);
+
+/* Terminal size changed; the cached width is re-read on next use */
+static volatile sig_atomic_t winch_pending = 1;
+
+void sigwinch_handler(int sig) {
     (void)sig;
-    int saved_errno = errno;
-    while (waitpid(-1, NULL, WNOHANG) > 0);
-    errno = saved_errno;
+    winch_pending = 1;
 }
 
-/* ===== Tokenizer ===== */
+/* ===== Tracing ===== */
+/*
+ * XSH_TRACE=file appends Chrome trace events (chrome://tracing, Perfetto)
+ * for the shell's own phases -- parse, expand, glob, $(...),
+ * launch, builtins -- plus one complete event per child process with its
+ * wall time and the CPU time reported by wait4(). Each event is a single
+ * write() on an O_APPEND fd, so forked subshells share the file safely.
+ * With tracing off every probe is one test of trace_fd.
+ */
+static int trace_fd = -1;
+static char *trace_path;
+
+#define TRACE_BEGIN(name, detail)  do { if (trace_fd >= 0) trace_event("B", name, detail); } while (0)
+#define TRACE_END(name)            do { if (trace_fd >= 0) trace_event("E", name, NULL); } while (0)
+
 typedef struct {
-    char **tokens;
-    int count;
-    int pipe_positions[MAX_ARGS]; /* indices where pipes occur */
-    int pipe_count;
-    char *input_file;
-    char *output_file;
-    int append_output;
-} ParseResult;
+    pid_t pid;
+    long long start;
+    char name[64];
+} TraceChild;
+
+#define TRACE_CHILDREN 256
+static TraceChild trace_children[TRACE_CHILDREN];
+static int trace_next_child;
+
+static long long trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
-void free_parse_result(ParseResult *pr) {
-    if (!pr) return;
-    for (int i = 0; i < pr->count; i++) {
-        free(pr->tokens[i]);
+/* Follow changes to XSH_TRACE; called before each top-level line */
+static void trace_sync(void) {
+    const char *path = var_get("XSH_TRACE");
+    if (path && !*path) path = NULL;
+    if (!path && !trace_path) return;
+    if (path && trace_path && strcmp(path, trace_path) == 0) return;
+
+    if (trace_fd >= 0) close(trace_fd);
+    free(trace_path);
+    trace_fd = -1;
+    trace_path = path ? strdup(path) : NULL;
+    if (!path) return;
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        fprintf(stderr, "xsh: XSH_TRACE: %s: %s\n", path, strerror(errno));
+        return;
     }
-    free(pr->tokens);
-    free(pr->input_file);
-    free(pr->output_file);
+    /* The JSON array form; viewers accept it without the closing bracket */
+    if (lseek(trace_fd, 0, SEEK_END) == 0 && write(trace_fd, "[\n", 2) < 0) {}
 }
 
-/* Expand environment variables in a token */
-char *expand_token(const char *tok) {
-    if (!tok) return NULL;
-    char buf[MAX_CMD_LEN];
-    int bi = 0;
-    int ti = 0;
-    int len = strlen(tok);
-
-    while (ti < len && bi < MAX_CMD_LEN - 1) {
-        if (tok[ti] == '$') {
-            ti++;
-            if (tok[ti] == '{') {
-                ti++;
-                char varname[256];
-                int vi = 0;
-                while (tok[ti] && tok[ti] != '}' && vi < 255) {
-                    varname[vi++] = tok[ti++];
-                }
-                varname[vi] = '\0';
-                if (tok[ti] == '}') ti++;
-                char *val = getenv(varname);
-                if (val) {
-                    int vl = strlen(val);
-                    if (bi + vl < MAX_CMD_LEN - 1) {
-                        memcpy(buf + bi, val, vl);
-                        bi += vl;
-                    }
-                }
-            } else if (tok[ti] == '(') {
-                /* Command substitution $(...) */
-                ti++;
-                char cmd[MAX_CMD_LEN];
-                int ci2 = 0;
-                int depth = 1;
-                while (tok[ti] && depth > 0 && ci2 < MAX_CMD_LEN - 1) {
-                    if (tok[ti] == '(') depth++;
-                    else if (tok[ti] == ')') { depth--; if (depth == 0) { ti++; break; } }
-                    cmd[ci2++] = tok[ti++];
-                }
-                cmd[ci2] = '\0';
-                /* Execute command and capture output */
-                FILE *fp = popen(cmd, "r");
-                if (fp) {
-                    char out[MAX_CMD_LEN];
-                    int oi = 0;
-                    int c;
-                    while ((c = fgetc(fp)) != EOF && oi < MAX_CMD_LEN - 1) {
-                        out[oi++] = c;
-                    }
-                    pclose(fp);
-                    /* Strip trailing newlines */
-                    while (oi > 0 && out[oi-1] == '\n') oi--;
-                    out[oi] = '\0';
-                    if (bi + oi < MAX_CMD_LEN - 1) {
-                        memcpy(buf + bi, out, oi);
-                        bi += oi;
-                    }
-                }
-            } else if (tok[ti] == '?') {
-                ti++;
-                char num[16];
-                snprintf(num, sizeof(num), "%d", last_exit_code);
-                int nl = strlen(num);
-                memcpy(buf + bi, num, nl);
-                bi += nl;
-            } else if (tok[ti] == '$') {
-                ti++;
-                char num[16];
-                snprintf(num, sizeof(num), "%d", getpid());
-                int nl = strlen(num);
-                memcpy(buf + bi, num, nl);
-                bi += nl;
-            } else {
-                char varname[256];
-                int vi = 0;
-                while (tok[ti] && (isalnum(tok[ti]) || tok[ti] == '_') && vi < 255) {
-                    varname[vi++] = tok[ti++];
-                }
-                varname[vi] = '\0';
-                char *val = getenv(varname);
-                if (val) {
-                    int vl = strlen(val);
-                    if (bi + vl < MAX_CMD_LEN - 1) {
-                        memcpy(buf + bi, val, vl);
-                        bi += vl;
-                    }
-                }
-            }
-        } else if (tok[ti] == '~' && bi == 0) {
-            ti++;
-            char *home = getenv("HOME");
-            if (home) {
-                int hl = strlen(home);
-                memcpy(buf + bi, home, hl);
-                bi += hl;
-            } else {
-                buf[bi++] = '~';
-            }
+/* Copy s into a JSON string body, truncating at n-1 bytes */
+static void json_escape(char *dst, size_t n, const char *s) {
+    size_t o = 0;
+    for (; *s && o + 7 < n; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            dst[o++] = '\\';
+            dst[o++] = c;
+        } else if (c < 0x20) {
+            o += snprintf(dst + o, n - o, "\\u%04x", c);
         } else {
-            buf[bi++] = tok[ti++];
+            dst[o++] = c;
         }
     }
-    buf[bi] = '\0';
-    return strdup(buf);
+    dst[o] = '\0';
 }
 
-ParseResult *parse_line(const char *line) {
-    ParseResult *pr = calloc(1, sizeof(ParseResult));
-    pr->tokens = malloc(MAX_ARGS * sizeof(char*));
-    pr->count = 0;
-    pr->pipe_count = 0;
-    pr->input_file = NULL;
-    pr->output_file = NULL;
-    pr->append_output = 0;
-
-    char buf[MAX_CMD_LEN];
-    int bi = 0;
-    int in_single = 0, in_double = 0;
-    int i = 0;
-    int len = strlen(line);
+static void trace_write(const char *ev, int len) {
+    if (len > 0 && write(trace_fd, ev, len) < 0) {}
+}
 
-    while (i <= len) {
-        char c = line[i];
+static void trace_event(const char *ph, const char *name, const char *detail) {
+    char ev[512], esc[256];
+    int pid = getpid();
+    int len;
+    if (detail) {
+        json_escape(esc, sizeof(esc), detail);
+        len = snprintf(ev, sizeof(ev),
+                       "{\"name\":\"%s\",\"cat\":\"xsh\",\"ph\":\"%s\",\"ts\":%lld,"
+                       "\"pid\":%d,\"tid\":%d,\"args\":{\"detail\":\"%s\"}},\n",
+                       name, ph, trace_now(), pid, pid, esc);
+    } else {
+        len = snprintf(ev, sizeof(ev),
+                       "{\"name\":\"%s\",\"cat\":\"xsh\",\"ph\":\"%s\",\"ts\":%lld,"
+                       "\"pid\":%d,\"tid\":%d},\n",
+                       name, ph, trace_now(), pid, pid);
+    }
+    trace_write(ev, len < (int)sizeof(ev) ? len : (int)sizeof(ev) - 1);
+}
 
-        if (c == '\'' && !in_double) {
-            in_single = !in_single;
-            i++;
-            continue;
-        }
-        if (c == '"' && !in_single) {
-            in_double = !in_double;
-            i++;
-            continue;
-        }
+/* Remember when a child started so its exit can be drawn as a span */
+static void trace_child_start(pid_t pid, const char *name) {
+    if (trace_fd < 0 || pid <= 0) return;
+    TraceChild *t = &trace_children[trace_next_child++ % TRACE_CHILDREN];
+    t->pid = pid;
+    t->start = trace_now();
+    snprintf(t->name, sizeof(t->name), "%s", name);
+}
 
-        /* Handle pipes (but not ||) */
-        if (c == '|' && !in_single && !in_double && line[i+1] != '|') {
-            if (bi > 0) {
-                buf[bi] = '\0';
-                pr->tokens[pr->count++] = expand_token(buf);
-                bi = 0;
-            }
-            pr->pipe_positions[pr->pipe_count++] = pr->count;
-            i++;
-            continue;
-        }
+static void trace_child_done(pid_t pid, int status, const struct rusage *ru) {
+    if (trace_fd < 0) return;
+    TraceChild *t = NULL;
+    for (int i = 0; i < TRACE_CHILDREN; i++)
+        if (trace_children[i].pid == pid) t = &trace_children[i];
+    if (!t) return;
+
+    char ev[512], esc[128];
+    json_escape(esc, sizeof(esc), t->name);
+    int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    int shell = getpid();
+    int len = snprintf(ev, sizeof(ev),
+        "{\"name\":\"%s\",\"cat\":\"process\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+        "\"pid\":%d,\"tid\":%d,\"args\":{\"pid\":%d,\"status\":%d,"
+        "\"user_ms\":%.3f,\"sys_ms\":%.3f,\"maxrss_kb\":%ld}},\n",
+        esc, t->start, trace_now() - t->start, shell, (int)pid, (int)pid, code,
+        ru->ru_utime.tv_sec * 1e3 + ru->ru_utime.tv_usec / 1e3,
+        ru->ru_stime.tv_sec * 1e3 + ru->ru_stime.tv_usec / 1e3,
+        ru->ru_maxrss);
+    trace_write(ev, len < (int)sizeof(ev) ? len : (int)sizeof(ev) - 1);
+    t->pid = 0;
+}
 
-        /* Handle redirections */
-        if (c == '<' && !in_single && !in_double) {
-            if (bi > 0) {
-                buf[bi] = '\0';
-                pr->tokens[pr->count++] = expand_token(buf);
-                bi = 0;
-            }
-            i++;
-            while (line[i] == ' ') i++;
-            int ri = 0;
-            char rbuf[MAX_PATH];
-            while (line[i] && line[i] != ' ' && line[i] != '>' && line[i] != '<') {
-                rbuf[ri++] = line[i++];
-            }
-            rbuf[ri] = '\0';
-            pr->input_file = strdup(rbuf);
-            continue;
-        }
+/* waitpid() that also records the child's span when tracing */
+static pid_t wait_child(pid_t pid, int *status, int options) {
+    if (trace_fd < 0) return waitpid(pid, status, options);
+    struct rusage ru;
+    pid_t r = wait4(pid, status, options, &ru);
+    if (r > 0) trace_child_done(r, *status, &ru);
+    return r;
+}
 
-        if (c == '>' && !in_single && !in_double) {
-            if (bi > 0) {
-                buf[bi] = '\0';
-                pr->tokens[pr->count++] = expand_token(buf);
-                bi = 0;
-            }
-            i++;
-            if (line[i] == '>') {
-                pr->append_output = 1;
-                i++;
-            }
-            while (line[i] == ' ') i++;
-            int ri = 0;
-            char rbuf[MAX_PATH];
-            while (line[i] && line[i] != ' ' && line[i] != '>' && line[i] != '<') {
-                rbuf[ri++] = line[i++];
-            }
-            rbuf[ri] = '\0';
-            pr->output_file = strdup(rbuf);
-            continue;
-        }
+/* ===== Arena Allocator ===== */
+/*
+ * Everything a command line allocates while it is parsed and expanded
+ * (tokens, AST, expanded words, glob results, argv) comes from cmd_arena.
+ * execute_line() takes a mark on entry and releases it on exit, so nested
+ * lines (source, $(...)) unwind in LIFO order and the top-level release
+ * returns the arena to empty. Released blocks are kept for reuse, so a
+ * long-running session settles at a flat footprint.
+ */
+#define ARENA_BLOCK_SIZE  (64 * 1024)
+#define ARENA_ALIGN       16
 
-        if ((c == ' ' || c == '\t' || c == '\0') && !in_single && !in_double) {
-            if (bi > 0) {
-                buf[bi] = '\0';
-                pr->tokens[pr->count++] = expand_token(buf);
-                bi = 0;
-            }
-            if (c == '\0') break;
-            i++;
-            continue;
-        }
+typedef struct ArenaBlock {
+    struct ArenaBlock *prev;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
 
-        buf[bi++] = c;
-        i++;
-    }
+typedef struct {
+    ArenaBlock *cur;
+    ArenaBlock *spare;      /* released standard-size blocks */
+    void *last;             /* most recent allocation, may grow in place */
+} Arena;
 
-    return pr;
-}
+typedef struct {
+    ArenaBlock *block;
+    size_t used;
+} ArenaMark;
 
-/* ===== Built-in Commands ===== */
+static Arena cmd_arena;
 
-/* cd */
-int builtin_cd(char **args, int argc) {
-    const char *target;
-    if (argc < 2 || args[1] == NULL) {
-        target = getenv("HOME");
-        if (!target) target = "/";
-    } else if (strcmp(args[1], "-") == 0) {
-        target = getenv("OLDPWD");
-        if (!target) {
-            fprintf(stderr, "xsh: cd: OLDPWD not set\n");
-            return 1;
-        }
-        printf("%s\n", target);
+static ArenaBlock *arena_new_block(Arena *a, size_t need) {
+    ArenaBlock *b;
+    if (need <= ARENA_BLOCK_SIZE && a->spare) {
+        b = a->spare;
+        a->spare = b->prev;
     } else {
-        target = args[1];
+        size_t size = need > ARENA_BLOCK_SIZE ? need : ARENA_BLOCK_SIZE;
+        b = malloc(sizeof(ArenaBlock) + size);
+        if (!b) { perror("xsh: malloc"); exit(1); }
+        b->size = size;
     }
+    b->used = 0;
+    b->prev = a->cur;
+    a->cur = b;
+    return b;
+}
 
-    char old[MAX_PATH];
-    getcwd(old, sizeof(old));
+void *arena_alloc(Arena *a, size_t n) {
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaBlock *b = a->cur;
+    if (!b || b->size - b->used < n) b = arena_new_block(a, n);
+    void *p = b->data + b->used;
+    b->used += n;
+    a->last = p;
+    return p;
+}
 
-    if (chdir(target) != 0) {
-        fprintf(stderr, FGRGB(255,80,80) "✗" RESET " xsh: cd: %s: %s\n", target, strerror(errno));
-        return 1;
+/* Grow an allocation; extends in place when it is the latest one */
+void *arena_realloc(Arena *a, void *old, size_t old_n, size_t new_n) {
+    if (old && old == a->last) {
+        ArenaBlock *b = a->cur;
+        size_t start = (char *)old - b->data;
+        size_t n = (new_n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        if (start + n <= b->size) {
+            b->used = start + n;
+            return old;
+        }
     }
-
-    setenv("OLDPWD", old, 1);
-    getcwd(cwd, sizeof(cwd));
-    setenv("PWD", cwd, 1);
-    return 0;
+    void *p = arena_alloc(a, new_n);
+    if (old) memcpy(p, old, old_n < new_n ? old_n : new_n);
+    return p;
 }
 
-/* pwd */
-int builtin_pwd(void) {
-    getcwd(cwd, sizeof(cwd));
-    printf(FGRGB(0,255,180) "%s\n" RESET, cwd);
-    return 0;
+char *arena_strndup(Arena *a, const char *s, size_t n) {
+    char *p = arena_alloc(a, n + 1);
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
 }
 
-/* echo */
-int builtin_echo(char **args, int argc) {
-    int newline = 1;
-    int start = 1;
-
-    if (argc > 1 && strcmp(args[1], "-n") == 0) {
-        newline = 0;
-        start = 2;
-    }
+char *arena_strdup(Arena *a, const char *s) {
+    return arena_strndup(a, s, strlen(s));
+}
 
-    for (int i = start; i < argc; i++) {
-        if (i > start) printf(" ");
-        /* Handle escape sequences */
-        const char *s = args[i];
-        while (*s) {
-            if (*s == '\\' && *(s+1)) {
-                s++;
-                switch (*s) {
-                    case 'n': printf("\n"); break;
-                    case 't': printf("\t"); break;
-                    case 'r': printf("\r"); break;
-                    case 'e': printf("\033"); break;
-                    case '\\': printf("\\"); break;
-                    default: printf("\\%c", *s); break;
-                }
-            } else {
-                putchar(*s);
-            }
-            s++;
-        }
-    }
-    if (newline) printf("\n");
-    return 0;
+ArenaMark arena_mark(Arena *a) {
+    ArenaMark m = { a->cur, a->cur ? a->cur->used : 0 };
+    return m;
 }
 
-/* export */
-int builtin_export(char **args, int argc) {
-    if (argc < 2) {
-        /* Print all env variables */
-        for (int i = 0; environ[i]; i++) {
-            printf(FGRGB(0,200,255) "export " RESET "%s\n", environ[i]);
-        }
-        return 0;
-    }
-    for (int i = 1; i < argc; i++) {
-        char *eq = strchr(args[i], '=');
-        if (eq) {
-            char varname[256];
-            int nlen = eq - args[i];
-            strncpy(varname, args[i], nlen);
-            varname[nlen] = '\0';
-            setenv(varname, eq + 1, 1);
+void arena_release(Arena *a, ArenaMark m) {
+    while (a->cur && a->cur != m.block) {
+        ArenaBlock *b = a->cur;
+        a->cur = b->prev;
+        if (b->size == ARENA_BLOCK_SIZE) {
+            b->prev = a->spare;
+            a->spare = b;
         } else {
-            /* Just mark for export (no-op for env vars already set) */
+            free(b);
         }
     }
-    return 0;
+    if (a->cur) a->cur->used = m.used;
+    a->last = NULL;
 }
 
-/* unset */
-int builtin_unset(char **args, int argc) {
-    for (int i = 1; i < argc; i++) {
-        unsetenv(args[i]);
+/* Growable string in cmd_arena */
+typedef struct {
+    char *s;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+static void sb_putn(StrBuf *b, const char *s, size_t n) {
+    if (b->len + n + 1 > b->cap) {
+        size_t nc = b->cap ? b->cap * 2 : 64;
+        while (nc < b->len + n + 1) nc *= 2;
+        b->s = arena_realloc(&cmd_arena, b->s, b->len, nc);
+        b->cap = nc;
     }
-    return 0;
+    memcpy(b->s + b->len, s, n);
+    b->len += n;
+    b->s[b->len] = '\0';
 }
 
-/* history - forward declaration, implemented after custom readline */
-int builtin_history(char **args, int argc);
+static void sb_puts(StrBuf *b, const char *s) {
+    if (s) sb_putn(b, s, strlen(s));
+}
 
-/* help */
-int builtin_help(void) {
-    printf("\n");
-    printf(FGRGB(0,255,200) BOLD "  ╔══════════════════════════════════════════════╗\n" RESET);
-    printf(FGRGB(0,255,200) BOLD "  ║       XSH - Built-in Commands                ║\n" RESET);
-    printf(FGRGB(0,255,200) BOLD "  ╚══════════════════════════════════════════════╝\n" RESET);
-    printf("\n");
+static void sb_putc(StrBuf *b, char c) {
+    sb_putn(b, &c, 1);
+}
 
-    struct { const char *cmd; const char *desc; } cmds[] = {
-        {"cd [dir]",       "Change directory (- for previous)"},
-        {"pwd",            "Print working directory"},
-        {"echo [args]",    "Print text (-n to suppress newline)"},
-        {"export [k=v]",   "Set/show environment variables"},
-        {"unset [var]",    "Unset environment variable"},
-        {"history [n]",    "Show command history"},
-        {"jobs",           "List background jobs"},
-        {"fg [job]",       "Bring job to foreground"},
-        {"bg [job]",       "Resume job in background"},
-        {"source [file]",  "Execute commands from file"},
-        {"alias [k=v]",    "Create or list aliases"},
-        {"unalias [name]", "Remove an alias"},
-        {"which [cmd]",    "Show command path"},
-        {"type [cmd]",     "Describe a command"},
-        {"true",           "Return exit code 0"},
-        {"false",          "Return exit code 1"},
-        {"exit [n]",       "Exit shell with code n"},
-        {"help",           "Show this help"},
-        {NULL, NULL}
-    };
-
-    for (int i = 0; cmds[i].cmd; i++) {
-        printf("  " FGRGB(0,220,255) BOLD "%-18s" RESET "  " FGRGB(180,180,200) "%s\n" RESET,
-               cmds[i].cmd, cmds[i].desc);
+/* Growable argv in cmd_arena, always NULL-terminated */
+typedef struct {
+    char **v;
+    int n;
+    int cap;
+} ArgVec;
+
+static void av_push(ArgVec *av, char *arg) {
+    if (av->n + 2 > av->cap) {
+        int nc = av->cap ? av->cap * 2 : 16;
+        av->v = arena_realloc(&cmd_arena, av->v, av->cap * sizeof(char*), nc * sizeof(char*));
+        av->cap = nc;
     }
-
-    printf("\n");
-    printf("  " FGRGB(100,100,150) "Features: pipes (|), redirection (< > >>), background (&),\n" RESET);
-    printf("  " FGRGB(100,100,150) "          glob expansion, env variables ($VAR), ~expansion\n" RESET);
-    printf("\n");
-    return 0;
+    av->v[av->n++] = arg;
+    av->v[av->n] = NULL;
 }
 
-/* ===== Alias System ===== */
-#define MAX_ALIASES 256
+/* ===== Lexer ===== */
+/*
+ * One left-to-right pass turns a command line into tokens. Words keep
+ * their quotes and $(...) bodies verbatim; quote removal and expansion
+ * happen later, per word, in expand_token().
+ */
+typedef enum {
+    TOK_WORD,
+    TOK_PIPE,       /* |  */
+    TOK_AND_IF,     /* && */
+    TOK_OR_IF,      /* || */
+    TOK_SEMI,       /* ;  */
+    TOK_AMP,        /* &  */
+    TOK_NEWLINE,
+    TOK_LESS,       /* <  */
+    TOK_GREAT,      /* >  */
+    TOK_DGREAT,     /* >> */
+    TOK_LESSAND,    /* <& */
+    TOK_GREATAND,   /* >& */
+    TOK_DLESS,      /* << */
+    TOK_DLESSDASH,  /* <<- */
+    TOK_EOF
+} TokType;
+
 typedef struct {
-    char *name;
-    char *value;
-} Alias;
+    TokType type;
+    char *text;     /* word text for TOK_WORD, body for TOK_DLESS[DASH] */
+    int io_number;  /* explicit fd before a redirection operator, or -1 */
+    struct AliasFrame *origin;  /* alias expansion that produced it, or NULL */
+} Token;
 
-static Alias aliases[MAX_ALIASES];
-static int alias_count = 0;
+typedef struct {
+    Token *toks;
+    int count;
+    int cap;
+} TokenList;
+
+static const char *tok_names[] = {
+    "word", "|", "&&", "||", ";", "&", "newline", "<", ">", ">>", "<&", ">&", "<<", "<<-", "end of input"
+};
+
+static void tok_push(TokenList *tl, TokType type, char *text, int io_number) {
+    if (tl->count == tl->cap) {
+        tl->cap = tl->cap ? tl->cap * 2 : 16;
+        tl->toks = arena_realloc(&cmd_arena, tl->toks, tl->count * sizeof(Token),
+                                 tl->cap * sizeof(Token));
+    }
+    tl->toks[tl->count].type = type;
+    tl->toks[tl->count].text = text;
+    tl->toks[tl->count].io_number = io_number;
+    tl->toks[tl->count].origin = NULL;
+    tl->count++;
+}
 
-void alias_set(const char *name, const char *value) {
-    for (int i = 0; i < alias_count; i++) {
-        if (strcmp(aliases[i].name, name) == 0) {
-            free(aliases[i].value);
-            aliases[i].value = strdup(value);
-            return;
+/* Index just past the ')' closing a $( opened before s[i]; -1 if unterminated */
+static int scan_subst(const char *s, int i) {
+    int depth = 1;
+    while (s[i]) {
+        char c = s[i];
+        if (c == '\\' && s[i+1]) { i += 2; continue; }
+        if (c == '\'') {
+            const char *q = strchr(s + i + 1, '\'');
+            if (!q) return -1;
+            i = q - s + 1;
+            continue;
         }
+        if (c == '"') {
+            i++;
+            while (s[i] && s[i] != '"') i += (s[i] == '\\' && s[i+1]) ? 2 : 1;
+            if (!s[i]) return -1;
+            i++;
+            continue;
+        }
+        if (c == '(') depth++;
+        else if (c == ')' && --depth == 0) return i + 1;
+        i++;
     }
-    if (alias_count < MAX_ALIASES) {
-        aliases[alias_count].name = strdup(name);
-        aliases[alias_count].value = strdup(value);
-        alias_count++;
-    }
+    return -1;
 }
 
-const char *alias_get(const char *name) {
-    for (int i = 0; i < alias_count; i++) {
-        if (strcmp(aliases[i].name, name) == 0)
-            return aliases[i].value;
+static int is_word_break(char c) {
+    return c == '\0' || c == ' ' || c == '\t' || c == '\n' ||
+           c == '|' || c == '&' || c == ';' || c == '<' || c == '>';
+}
+
+#define LEX_OK          0
+#define LEX_INCOMPLETE  1   /* unterminated quote, substitution or here-document */
+
+/*
+ * Here-documents: `<<WORD` records the operator, and the lines after the
+ * next newline up to a line reading WORD become the operator token's
+ * text. Quoting in WORD is removed from the delimiter (and, in the
+ * parser, turns expansion of the body off).
+ */
+#define MAX_HEREDOCS 16
+
+typedef struct {
+    int tok;                /* index of the << token */
+    const char *delim;
+} PendingDoc;
+
+static const char *heredoc_delim(const char *w) {
+    StrBuf d = {0};
+    for (; *w; w++) {
+        if (*w == '\'' || *w == '"') continue;
+        if (*w == '\\' && w[1]) w++;
+        sb_putc(&d, *w);
     }
-    return NULL;
+    return d.s ? d.s : "";
 }
 
-void alias_remove(const char *name) {
-    for (int i = 0; i < alias_count; i++) {
-        if (strcmp(aliases[i].name, name) == 0) {
-            free(aliases[i].name);
-            free(aliases[i].value);
-            aliases[i] = aliases[--alias_count];
-            return;
+/* Collect the bodies of docs[] starting at line[i]; index past the last delimiter, or -1 */
+static int lex_heredocs(const char *line, int i, TokenList *tl, PendingDoc *docs, int ndocs) {
+    for (int d = 0; d < ndocs; d++) {
+        int dash = tl->toks[docs[d].tok].type == TOK_DLESSDASH;
+        size_t dlen = strlen(docs[d].delim);
+        StrBuf body = {0};
+        while (1) {
+            if (!line[i]) return -1;
+            const char *nl = strchr(line + i, '\n');
+            int end = nl ? (int)(nl - line) : i + (int)strlen(line + i);
+            int s = i;
+            if (dash) while (line[s] == '\t') s++;
+            i = nl ? end + 1 : end;
+            if ((size_t)(end - s) == dlen && memcmp(line + s, docs[d].delim, dlen) == 0) break;
+            sb_putn(&body, line + s, end - s);
+            sb_putc(&body, '\n');
         }
+        if (!body.s) sb_putn(&body, "", 0);
+        tl->toks[docs[d].tok].text = body.s;
     }
+    return i;
 }
 
-int builtin_alias(char **args, int argc) {
-    if (argc < 2) {
-        for (int i = 0; i < alias_count; i++) {
-            printf(FGRGB(0,200,255) "alias " RESET "%s=" FGRGB(0,255,150) "'%s'\n" RESET,
-                   aliases[i].name, aliases[i].value);
+/* Drop backslash-newline pairs (outside single quotes) from a word */
+static void lex_join_lines(char *w) {
+    char *out = w;
+    char quote = 0;
+    while (*w) {
+        if (quote != '"' && *w == '\'') {
+            quote = quote ? 0 : '\'';
+        } else if (quote != '\'' && *w == '"') {
+            quote = quote ? 0 : '"';
+        } else if (quote != '\'' && *w == '\\' && w[1]) {
+            if (w[1] == '\n') { w += 2; continue; }
+            *out++ = *w++;
         }
-        return 0;
+        *out++ = *w++;
     }
-    for (int i = 1; i < argc; i++) {
-        char *eq = strchr(args[i], '=');
-        if (eq) {
-            char name[256];
-            int nlen = eq - args[i];
-            strncpy(name, args[i], nlen);
-            name[nlen] = '\0';
-            /* Strip surrounding quotes from value */
-            char *val = eq + 1;
-            int vlen = strlen(val);
-            if (vlen >= 2 && ((val[0] == '\'' && val[vlen-1] == '\'') ||
-                               (val[0] == '"' && val[vlen-1] == '"'))) {
-                char tmp[MAX_CMD_LEN];
-                strncpy(tmp, val + 1, vlen - 2);
-                tmp[vlen - 2] = '\0';
-                alias_set(name, tmp);
-            } else {
-                alias_set(name, val);
+    *out = '\0';
+}
+
+static int lex_line(const char *line, TokenList *tl) {
+    PendingDoc docs[MAX_HEREDOCS];
+    int ndocs = 0;
+    int i = 0;
+    while (1) {
+        char c = line[i];
+        if (c == ' ' || c == '\t') { i++; continue; }
+        if (c == '\0') break;
+        if (c == '\\' && line[i+1] == '\n') {
+            /* Line continuation; at the very end more input must follow */
+            if (!line[i+2]) return LEX_INCOMPLETE;
+            i += 2;
+            continue;
+        }
+        if (c == '#') {
+            while (line[i] && line[i] != '\n') i++;
+            continue;
+        }
+        if (c == '\n') {
+            tok_push(tl, TOK_NEWLINE, NULL, -1);
+            i++;
+            if (ndocs) {
+                i = lex_heredocs(line, i, tl, docs, ndocs);
+                if (i < 0) return LEX_INCOMPLETE;
+                ndocs = 0;
             }
-        } else {
-            const char *v = alias_get(args[i]);
-            if (v) {
-                printf(FGRGB(0,200,255) "alias " RESET "%s=" FGRGB(0,255,150) "'%s'\n" RESET, args[i], v);
+            continue;
+        }
+        if (c == '|') {
+            if (line[i+1] == '|') { tok_push(tl, TOK_OR_IF, NULL, -1); i += 2; }
+            else { tok_push(tl, TOK_PIPE, NULL, -1); i++; }
+            continue;
+        }
+        if (c == '&') {
+            if (line[i+1] == '&') { tok_push(tl, TOK_AND_IF, NULL, -1); i += 2; }
+            else { tok_push(tl, TOK_AMP, NULL, -1); i++; }
+            continue;
+        }
+        if (c == ';') { tok_push(tl, TOK_SEMI, NULL, -1); i++; continue; }
+        if (c == '<' || c == '>') {
+            int io = -1;
+            /* A preceding all-digit word glued to the operator is its fd */
+            if (tl->count > 0 && i > 0 && isdigit((unsigned char)line[i-1])) {
+                Token *prev = &tl->toks[tl->count - 1];
+                if (prev->type == TOK_WORD && prev->io_number == -2) {
+                    io = atoi(prev->text);
+                    tl->count--;
+                }
+            }
+            TokType t;
+            if (c == '<') {
+                if (line[i+1] == '&') { t = TOK_LESSAND; i += 2; }
+                else if (line[i+1] == '<' && line[i+2] == '-') { t = TOK_DLESSDASH; i += 3; }
+                else if (line[i+1] == '<') { t = TOK_DLESS; i += 2; }
+                else { t = TOK_LESS; i++; }
             } else {
-                fprintf(stderr, "xsh: alias: %s: not found\n", args[i]);
-                return 1;
+                if (line[i+1] == '>') { t = TOK_DGREAT; i += 2; }
+                else if (line[i+1] == '&') { t = TOK_GREATAND; i += 2; }
+                else { t = TOK_GREAT; i++; }
             }
+            tok_push(tl, t, NULL, io);
+            continue;
         }
-    }
-    return 0;
-}
 
-int builtin_unalias(char **args, int argc) {
-    for (int i = 1; i < argc; i++) {
-        alias_remove(args[i]);
-    }
-    return 0;
-}
-
-/* ===== which / type ===== */
-int builtin_which(char **args, int argc) {
-    for (int i = 1; i < argc; i++) {
-        char *path_env = getenv("PATH");
-        if (!path_env) continue;
-        char path_copy[MAX_CMD_LEN];
-        strncpy(path_copy, path_env, sizeof(path_copy) - 1);
-        char *dir = strtok(path_copy, ":");
-        int found = 0;
-        while (dir) {
-            char full[MAX_PATH];
-            snprintf(full, sizeof(full), "%s/%s", dir, args[i]);
-            if (access(full, X_OK) == 0) {
-                printf(FGRGB(0,255,150) "%s\n" RESET, full);
-                found = 1;
-                break;
+        /* Word */
+        int start = i;
+        int all_digits = 1;
+        while (!is_word_break(line[i])) {
+            char w = line[i];
+            if (!isdigit((unsigned char)w)) all_digits = 0;
+            if (w == '\\') {
+                if (line[i+1] == '\n' && !line[i+2]) return LEX_INCOMPLETE;
+                i += line[i+1] ? 2 : 1;
+            } else if (w == '\'') {
+                const char *q = strchr(line + i + 1, '\'');
+                if (!q) return LEX_INCOMPLETE;
+                i = q - line + 1;
+            } else if (w == '"') {
+                i++;
+                while (line[i] && line[i] != '"') {
+                    if (line[i] == '\\' && line[i+1]) i += 2;
+                    else if (line[i] == '$' && line[i+1] == '(') {
+                        int e = scan_subst(line, i + 2);
+                        if (e < 0) return LEX_INCOMPLETE;
+                        i = e;
+                    } else i++;
+                }
+                if (!line[i]) return LEX_INCOMPLETE;
+                i++;
+            } else if (w == '$' && line[i+1] == '(') {
+                int e = scan_subst(line, i + 2);
+                if (e < 0) return LEX_INCOMPLETE;
+                i = e;
+            } else if (w == '$' && line[i+1] == '{') {
+                const char *q = strchr(line + i, '}');
+                if (!q) return LEX_INCOMPLETE;
+                i = q - line + 1;
+            } else {
+                i++;
             }
-            dir = strtok(NULL, ":");
         }
-        if (!found) {
-            fprintf(stderr, "xsh: which: %s: not found\n", args[i]);
-            return 1;
+        char *text = arena_strndup(&cmd_arena, line + start, i - start);
+        if (memchr(text, '\n', i - start)) lex_join_lines(text);
+        /* -2 marks a bare number that may turn out to be an io_number */
+        tok_push(tl, TOK_WORD, text, (all_digits && (line[i] == '<' || line[i] == '>')) ? -2 : -1);
+        if (tl->count > 1) {
+            Token *op = &tl->toks[tl->count - 2];
+            if ((op->type == TOK_DLESS || op->type == TOK_DLESSDASH) && !op->text &&
+                ndocs < MAX_HEREDOCS) {
+                docs[ndocs].tok = tl->count - 2;
+                docs[ndocs++].delim = heredoc_delim(text);
+            }
         }
     }
-    return 0;
+    /* A here-document still waiting for its body needs more lines */
+    if (ndocs) return LEX_INCOMPLETE;
+    tok_push(tl, TOK_EOF, NULL, -1);
+    return LEX_OK;
 }
 
-/* ===== Job Control ===== */
-#define MAX_JOBS 64
+/* ===== Parser / AST ===== */
+/*
+ * Grammar (a subset of the POSIX shell grammar):
+ *   list     := and_or ((';' | '&' | NEWLINE) and_or)* [';' | '&']
+ *   and_or   := pipeline (('&&' | '||') NEWLINE* pipeline)*
+ *   pipeline := command ('|' NEWLINE* command)*
+ *   command  := (WORD | redirect)+ | for_loop redirect*
+ *   for_loop := 'for' NAME NEWLINE* 'in' WORD* (';' | NEWLINE) NEWLINE*
+ *               'do' list 'done'
+ *   redirect := [IO_NUMBER] ('<' | '>' | '>>' | '<&' | '>&' | '<<' | '<<-') WORD
+ */
+typedef enum { REDIR_IN, REDIR_OUT, REDIR_APPEND, REDIR_DUP, REDIR_HEREDOC } RedirType;
+
+typedef struct Redir {
+    RedirType type;
+    int fd;                 /* descriptor being redirected */
+    char *target;           /* file name, fd number or `-` for REDIR_DUP, body for REDIR_HEREDOC */
+    int literal;            /* here-document delimiter was quoted: no expansion */
+    int implicit_fd;        /* no io number was written: `>&file` means stdout and stderr */
+    struct Redir *next;
+} Redir;
+
+struct ForLoop;
+
 typedef struct {
-    pid_t pid;
-    int job_id;
-    char cmd[256];
-    int running;
-} Job;
+    char **words;           /* raw words, NULL-terminated */
+    int nwords;
+    Redir *redirs;
+    struct ForLoop *loop;   /* compound command: words is empty */
+} Command;
 
-static Job jobs[MAX_JOBS];
-static int job_count = 0;
-static int next_job_id = 1;
+typedef struct {
+    Command *cmds;
+    int ncmds;
+} Pipeline;
 
-Job *job_add(pid_t pid, const char *cmd) {
-    if (job_count >= MAX_JOBS) return NULL;
-    for (int i = 0; i < MAX_JOBS; i++) {
-        if (jobs[i].pid == 0) {
-            jobs[i].pid = pid;
-            jobs[i].job_id = next_job_id++;
-            strncpy(jobs[i].cmd, cmd, 255);
-            jobs[i].running = 1;
-            job_count++;
-            return &jobs[i];
-        }
+#define AO_AND 1
+#define AO_OR  2
+
+typedef struct {
+    Pipeline *pipes;
+    int *ops;               /* ops[i] joins pipes[i-1] and pipes[i] */
+    int npipes;
+    int background;
+} AndOr;
+
+typedef struct {
+    AndOr *items;
+    int nitems;
+} CmdList;
+
+typedef struct ForLoop {
+    char *name;
+    char **words;           /* raw words after `in`, brace-expanded as the loop runs */
+    int nwords;
+    CmdList *body;
+} ForLoop;
+
+typedef struct {
+    Token *toks;
+    int ntoks;
+    int pos;
+    int error;
+    int alias_next;         /* token after a blank-terminated alias: check it too */
+} Parser;
+
+#define PARSE_OK          0
+#define PARSE_ERROR       1
+#define PARSE_INCOMPLETE  2
+
+static Token *p_peek(Parser *p) { return &p->toks[p->pos]; }
+
+static int parse_quiet;     /* set while only probing for completeness */
+
+static void p_syntax_error(Parser *p) {
+    if (p->error) return;
+    Token *t = p_peek(p);
+    if (t->type == TOK_EOF) {
+        p->error = PARSE_INCOMPLETE;
+        return;
     }
-    return NULL;
+    if (!parse_quiet) fprintf(stderr, "xsh: syntax error near unexpected token `%s'\n",
+            t->type == TOK_WORD ? t->text : tok_names[t->type]);
+    p->error = PARSE_ERROR;
 }
 
-void job_remove(pid_t pid) {
-    for (int i = 0; i < MAX_JOBS; i++) {
-        if (jobs[i].pid == pid) {
-            jobs[i].pid = 0;
-            jobs[i].running = 0;
-            job_count--;
-            return;
-        }
-    }
+static void p_skip_newlines(Parser *p) {
+    while (p_peek(p)->type == TOK_NEWLINE) p->pos++;
 }
 
-int builtin_jobs(void) {
-    for (int i = 0; i < MAX_JOBS; i++) {
-        if (jobs[i].pid != 0) {
-            int status;
-            int r = waitpid(jobs[i].pid, &status, WNOHANG);
-            if (r == jobs[i].pid) {
-                /* Job finished */
-                printf("[%d] Done     %s\n", jobs[i].job_id, jobs[i].cmd);
-                job_remove(jobs[i].pid);
-            } else {
-                printf(FGRGB(0,200,255) "[%d]" RESET " Running   " FGRGB(200,200,200) "%s\n" RESET,
-                       jobs[i].job_id, jobs[i].cmd);
-            }
-        }
+/*
+ * Aliases are expanded here, on tokens: a command word naming an alias is
+ * replaced by the alias body, lexed once when the alias was defined.
+ * Each splice records its alias in the new tokens' origin chain, and a
+ * word is never expanded by an alias already on its chain, which ends
+ * both `alias ls='ls -F'` and loops like a=b, b=a.
+ */
+struct Alias {
+    char *name;
+    char *value;
+    Token *toks;            /* body tokens without TOK_EOF; NULL if the body is incomplete */
+    int ntoks;
+    int blank;              /* value ends in a blank: the next word is checked too */
+    int index;              /* position in aliases[] */
+    struct Alias *next;     /* hash chain */
+};
+typedef struct Alias Alias;
+
+typedef struct AliasFrame {
+    const char *name;
+    struct AliasFrame *parent;
+} AliasFrame;
+
+static Alias *alias_find(const char *name);
+
+/* Replace the word at p->pos by its alias body; 0 if it is not an alias */
+static int p_expand_alias(Parser *p) {
+    Token *t = p_peek(p);
+    for (AliasFrame *f = t->origin; f; f = f->parent)
+        if (strcmp(f->name, t->text) == 0) return 0;
+    Alias *a = alias_find(t->text);
+    if (!a) return 0;
+    if (!a->toks) {
+        if (!parse_quiet) fprintf(stderr, "xsh: %s: alias body is incomplete\n", a->name);
+        p->error = PARSE_ERROR;
+        return 0;
     }
-    return 0;
+    AliasFrame *fr = arena_alloc(&cmd_arena, sizeof(AliasFrame));
+    fr->name = t->text;
+    fr->parent = t->origin;
+
+    /* Tokens before pos are done with; the new array starts at the splice */
+    int rest = p->ntoks - p->pos - 1;
+    Token *nt = arena_alloc(&cmd_arena, (a->ntoks + rest) * sizeof(Token));
+    for (int i = 0; i < a->ntoks; i++) {
+        nt[i] = a->toks[i];
+        if (nt[i].text) nt[i].text = arena_strdup(&cmd_arena, nt[i].text);
+        nt[i].origin = fr;
+    }
+    memcpy(nt + a->ntoks, p->toks + p->pos + 1, rest * sizeof(Token));
+    p->toks = nt;
+    p->ntoks = a->ntoks + rest;
+    p->pos = 0;
+    p->alias_next = a->blank ? a->ntoks : -1;
+    return 1;
 }
 
-int builtin_fg(char **args, int argc) {
-    if (job_count == 0) {
-        fprintf(stderr, "xsh: fg: no current job\n");
-        return 1;
+/* Is the next token the unquoted reserved word `w`? */
+static int p_reserved(Parser *p, const char *w) {
+    Token *t = p_peek(p);
+    return t->type == TOK_WORD && strcmp(t->text, w) == 0;
+}
+
+static int is_redir_tok(TokType t) {
+    return t == TOK_LESS || t == TOK_GREAT || t == TOK_DGREAT ||
+           t == TOK_LESSAND || t == TOK_GREATAND || t == TOK_DLESS || t == TOK_DLESSDASH;
+}
+
+static int parse_list(Parser *p, CmdList *l, const char *end);
+static int parse_redirect(Parser *p, Redir ***tail);
+
+static int parse_for(Parser *p, Command *c) {
+    p->pos++;
+    Token *t = p_peek(p);
+    const char *n = t->type == TOK_WORD ? t->text : "";
+    int valid = isalpha((unsigned char)n[0]) || n[0] == '_';
+    for (const char *q = n; *q && valid; q++) valid = isalnum((unsigned char)*q) || *q == '_';
+    if (!valid) {
+        p_syntax_error(p);
+        return 0;
     }
-    int jid = (argc > 1) ? atoi(args[1]) : -1;
-    for (int i = 0; i < MAX_JOBS; i++) {
-        if (jobs[i].pid != 0 && (jid == -1 || jobs[i].job_id == jid)) {
-            kill(jobs[i].pid, SIGCONT);
-            int status;
-            waitpid(jobs[i].pid, &status, 0);
-            job_remove(jobs[i].pid);
-            return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    ForLoop *f = arena_alloc(&cmd_arena, sizeof(ForLoop));
+    f->name = t->text;
+    p->pos++;
+    p_skip_newlines(p);
+    if (!p_reserved(p, "in")) {
+        p_syntax_error(p);
+        return 0;
+    }
+    p->pos++;
+    int cap = 8;
+    f->words = arena_alloc(&cmd_arena, cap * sizeof(char*));
+    f->nwords = 0;
+    while (p_peek(p)->type == TOK_WORD) {
+        if (f->nwords == cap) {
+            f->words = arena_realloc(&cmd_arena, f->words, cap * sizeof(char*),
+                                     cap * 2 * sizeof(char*));
+            cap *= 2;
         }
+        f->words[f->nwords++] = p_peek(p)->text;
+        p->pos++;
     }
-    fprintf(stderr, "xsh: fg: job not found\n");
+    TokType sep = p_peek(p)->type;
+    if (sep != TOK_SEMI && sep != TOK_NEWLINE) {
+        p_syntax_error(p);
+        return 0;
+    }
+    p->pos++;
+    p_skip_newlines(p);
+    if (!p_reserved(p, "do")) {
+        p_syntax_error(p);
+        return 0;
+    }
+    p->pos++;
+    f->body = arena_alloc(&cmd_arena, sizeof(CmdList));
+    if (!parse_list(p, f->body, "done")) return 0;
+    p->pos++;
+    c->loop = f;
+
+    Redir **tail = &c->redirs;
+    while (is_redir_tok(p_peek(p)->type))
+        if (!parse_redirect(p, &tail)) return 0;
     return 1;
 }
 
-int builtin_bg(char **args, int argc) {
-    int jid = (argc > 1) ? atoi(args[1]) : -1;
-    for (int i = 0; i < MAX_JOBS; i++) {
-        if (jobs[i].pid != 0 && (jid == -1 || jobs[i].job_id == jid)) {
-            kill(jobs[i].pid, SIGCONT);
-            jobs[i].running = 1;
-            printf("[%d] %d %s\n", jobs[i].job_id, jobs[i].pid, jobs[i].cmd);
-            return 0;
-        }
+/* Parse one redirection at p->pos and append it at *tail */
+static int parse_redirect(Parser *p, Redir ***tail) {
+    Token *t = p_peek(p);
+    TokType op = t->type;
+    int io = t->io_number;
+    char *body = t->text;
+    p->pos++;
+    Token *w = p_peek(p);
+    if (w->type != TOK_WORD) {
+        p_syntax_error(p);
+        return 0;
+    }
+    Redir *r = arena_alloc(&cmd_arena, sizeof(Redir));
+    r->next = NULL;
+    r->literal = 0;
+    r->target = w->text;
+    switch (op) {
+        case TOK_LESS:     r->type = REDIR_IN;     r->fd = 0; break;
+        case TOK_GREAT:    r->type = REDIR_OUT;    r->fd = 1; break;
+        case TOK_DGREAT:   r->type = REDIR_APPEND; r->fd = 1; break;
+        case TOK_LESSAND:  r->type = REDIR_DUP;    r->fd = 0; break;
+        case TOK_GREATAND: r->type = REDIR_DUP;    r->fd = 1; break;
+        default:
+            r->type = REDIR_HEREDOC;
+            r->fd = 0;
+            r->target = body ? body : "";
+            r->literal = strpbrk(w->text, "'\"\\") != NULL;
+            break;
     }
+    r->implicit_fd = io < 0;
+    if (io >= 0) r->fd = io;
+    p->pos++;
+    **tail = r;
+    *tail = &r->next;
     return 1;
 }
 
-/* ===== Source file ===== */
-/* Forward declaration */
-int execute_line(const char *line);
-
-int builtin_source(char **args, int argc) {
-    if (argc < 2) {
-        fprintf(stderr, "xsh: source: filename required\n");
-        return 1;
-    }
-    FILE *f = fopen(args[1], "r");
-    if (!f) {
-        fprintf(stderr, "xsh: source: %s: %s\n", args[1], strerror(errno));
-        return 1;
+static int parse_command(Parser *p, Command *c) {
+    int cap = 8;
+    c->words = arena_alloc(&cmd_arena, cap * sizeof(char*));
+    c->nwords = 0;
+    c->redirs = NULL;
+    c->loop = NULL;
+    Redir **tail = &c->redirs;
+
+    if (p_reserved(p, "for")) {
+        int ok = parse_for(p, c);
+        c->words[0] = NULL;
+        return ok;
     }
-    char line[MAX_CMD_LEN];
-    int ret = 0;
-    while (fgets(line, sizeof(line), f)) {
-        line[strcspn(line, "\n")] = '\0';
-        if (line[0] == '#' || line[0] == '\0') continue;
-        ret = execute_line(line);
+    if (p_reserved(p, "do") || p_reserved(p, "done")) {
+        p_syntax_error(p);
+        return 0;
     }
-    fclose(f);
-    return ret;
-}
 
-/* ===== Glob Expansion ===== */
-char **expand_globs(char **tokens, int count, int *new_count) {
-    char **result = malloc(MAX_ARGS * sizeof(char*));
-    *new_count = 0;
-
-    for (int i = 0; i < count && *new_count < MAX_ARGS; i++) {
-        if (strpbrk(tokens[i], "*?[")) {
-            glob_t g;
-            int r = glob(tokens[i], GLOB_NOCHECK | GLOB_TILDE, NULL, &g);
-            if (r == 0) {
-                for (size_t j = 0; j < g.gl_pathc && *new_count < MAX_ARGS; j++) {
-                    result[(*new_count)++] = strdup(g.gl_pathv[j]);
-                }
-                globfree(&g);
-            } else {
-                result[(*new_count)++] = strdup(tokens[i]);
+    while (1) {
+        Token *t = p_peek(p);
+        if (t->type == TOK_WORD) {
+            if ((c->nwords == 0 || p->pos == p->alias_next) && p_expand_alias(p)) continue;
+            if (p->error) break;
+            if (c->nwords + 1 >= cap) {
+                c->words = arena_realloc(&cmd_arena, c->words, cap * sizeof(char*),
+                                         cap * 2 * sizeof(char*));
+                cap *= 2;
             }
+            c->words[c->nwords++] = t->text;
+            p->pos++;
+        } else if (is_redir_tok(t->type)) {
+            if (!parse_redirect(p, &tail)) break;
         } else {
-            result[(*new_count)++] = strdup(tokens[i]);
+            break;
         }
     }
-    result[*new_count] = NULL;
-    return result;
+    c->words[c->nwords] = NULL;
+    if (c->nwords == 0 && !c->redirs && !p->error) p_syntax_error(p);
+    return !p->error;
 }
 
-/* ===== Execute External Command ===== */
-int execute_external(char **args, int argc, char *input_file, char *output_file, int append) {
-    (void)argc;
-    /* Expand globs */
-    int new_count;
-    char **expanded = expand_globs(args, argc, &new_count);
-
-    pid_t pid = fork();
-    if (pid == 0) {
-        /* Setup redirections */
-        if (input_file) {
-            int fd = open(input_file, O_RDONLY);
-            if (fd < 0) {
-                fprintf(stderr, "xsh: %s: %s\n", input_file, strerror(errno));
-                exit(1);
-            }
-            dup2(fd, STDIN_FILENO);
-            close(fd);
-        }
-        if (output_file) {
-            int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
-            int fd = open(output_file, flags, 0644);
-            if (fd < 0) {
-                fprintf(stderr, "xsh: %s: %s\n", output_file, strerror(errno));
-                exit(1);
-            }
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
+static int parse_pipeline(Parser *p, Pipeline *pl) {
+    int cap = 2;
+    pl->cmds = arena_alloc(&cmd_arena, cap * sizeof(Command));
+    pl->ncmds = 0;
+    while (1) {
+        if (pl->ncmds == cap) {
+            pl->cmds = arena_realloc(&cmd_arena, pl->cmds, cap * sizeof(Command),
+                                     cap * 2 * sizeof(Command));
+            cap *= 2;
         }
-
-        /* Reset signal handlers */
-        signal(SIGINT, SIG_DFL);
-        signal(SIGQUIT, SIG_DFL);
-
-        execvp(expanded[0], expanded);
-        fprintf(stderr, FGRGB(255,80,80) "✗" RESET " xsh: %s: %s\n", expanded[0], strerror(errno));
-        exit(127);
-    } else if (pid < 0) {
-        perror("xsh: fork");
-        for (int i = 0; expanded[i]; i++) free(expanded[i]);
-        free(expanded);
-        return 1;
+        if (!parse_command(p, &pl->cmds[pl->ncmds++])) return 0;
+        if (p_peek(p)->type != TOK_PIPE) return 1;
+        p->pos++;
+        p_skip_newlines(p);
     }
-
-    int status;
-    waitpid(pid, &status, 0);
-    for (int i = 0; expanded[i]; i++) free(expanded[i]);
-    free(expanded);
-    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
 }
 
-/* ===== Execute Pipeline ===== */
-int execute_pipeline(char **all_tokens, int *pipe_positions, int pipe_count, int total_count,
-                     char *input_file, char *output_file, int append) {
-    if (pipe_count == 0) {
-        /* No pipe, just execute */
-        int argc = total_count;
-        char **args = all_tokens;
-        args[argc] = NULL;
-
-        /* Check for background */
-        int background = 0;
-        if (argc > 0 && strcmp(args[argc - 1], "&") == 0) {
-            background = 1;
-            args[--argc] = NULL;
-        }
-
-        if (argc == 0) return 0;
-
-        /* Check for variable assignment: KEY=value */
-        if (strchr(args[0], '=') && args[0][0] != '=') {
-            /* Handle multiple assignments like: A=1 B=2 cmd or just A=1 */
-            int last_assign = -1;
-            for (int i = 0; i < argc; i++) {
-                char *eq = strchr(args[i], '=');
-                if (eq && eq != args[i]) {
-                    /* Check all chars before = are valid identifier chars */
-                    int valid = 1;
-                    for (char *p = args[i]; p < eq; p++) {
-                        if (!isalnum((unsigned char)*p) && *p != '_') { valid = 0; break; }
-                    }
-                    if (valid) last_assign = i;
-                    else break;
-                } else break;
-            }
-            if (last_assign == argc - 1) {
-                /* Pure assignment(s), no command */
-                for (int i = 0; i <= last_assign; i++) {
-                    char *eq = strchr(args[i], '=');
-                    char varname[256];
-                    int nlen = eq - args[i];
-                    strncpy(varname, args[i], nlen);
-                    varname[nlen] = '\0';
-                    setenv(varname, eq + 1, 1);
-                }
-                return 0;
-            }
+static int parse_and_or(Parser *p, AndOr *ao) {
+    int cap = 2;
+    ao->pipes = arena_alloc(&cmd_arena, cap * sizeof(Pipeline));
+    ao->ops = arena_alloc(&cmd_arena, cap * sizeof(int));
+    ao->npipes = 0;
+    ao->background = 0;
+    int op = 0;
+    while (1) {
+        if (ao->npipes == cap) {
+            ao->pipes = arena_realloc(&cmd_arena, ao->pipes, cap * sizeof(Pipeline),
+                                      cap * 2 * sizeof(Pipeline));
+            ao->ops = arena_realloc(&cmd_arena, ao->ops, cap * sizeof(int), cap * 2 * sizeof(int));
+            cap *= 2;
         }
+        ao->ops[ao->npipes] = op;
+        if (!parse_pipeline(p, &ao->pipes[ao->npipes++])) return 0;
+        TokType t = p_peek(p)->type;
+        if (t != TOK_AND_IF && t != TOK_OR_IF) return 1;
+        op = (t == TOK_AND_IF) ? AO_AND : AO_OR;
+        p->pos++;
+        p_skip_newlines(p);
+    }
+}
 
-        /* Check alias */
-        const char *alias_val = alias_get(args[0]);
-        if (alias_val) {
-            char expanded[MAX_CMD_LEN];
-            /* Build new command: alias_val + rest of args */
-            strncpy(expanded, alias_val, sizeof(expanded) - 1);
-            for (int i = 1; i < argc; i++) {
-                strncat(expanded, " ", sizeof(expanded) - strlen(expanded) - 1);
-                strncat(expanded, args[i], sizeof(expanded) - strlen(expanded) - 1);
-            }
-            return execute_line(expanded);
+/* A list runs to the end of input, or up to the reserved word `end` */
+static int parse_list(Parser *p, CmdList *l, const char *end) {
+    int cap = 4;
+    l->items = arena_alloc(&cmd_arena, cap * sizeof(AndOr));
+    l->nitems = 0;
+    p_skip_newlines(p);
+    while (!(end && p_reserved(p, end))) {
+        if (p_peek(p)->type == TOK_EOF) {
+            if (!end) break;
+            p_syntax_error(p);
+            return 0;
         }
-
-        /* Builtins - handle redirections by saving/restoring stdio */
-        int saved_stdout = -1, saved_stdin = -1;
-        if (output_file) {
-            int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
-            int fd = open(output_file, flags, 0644);
-            if (fd < 0) {
-                fprintf(stderr, "xsh: %s: %s\n", output_file, strerror(errno));
-                return 1;
-            }
-            saved_stdout = dup(STDOUT_FILENO);
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
+        if (l->nitems == cap) {
+            l->items = arena_realloc(&cmd_arena, l->items, cap * sizeof(AndOr),
+                                     cap * 2 * sizeof(AndOr));
+            cap *= 2;
         }
-        if (input_file) {
-            int fd = open(input_file, O_RDONLY);
-            if (fd < 0) {
-                fprintf(stderr, "xsh: %s: %s\n", input_file, strerror(errno));
-                if (saved_stdout >= 0) { dup2(saved_stdout, STDOUT_FILENO); close(saved_stdout); }
-                return 1;
-            }
-            saved_stdin = dup(STDIN_FILENO);
-            dup2(fd, STDIN_FILENO);
-            close(fd);
+        AndOr *ao = &l->items[l->nitems++];
+        if (!parse_and_or(p, ao)) return 0;
+        TokType t = p_peek(p)->type;
+        if (t == TOK_AMP) ao->background = 1;
+        if (t == TOK_AMP || t == TOK_SEMI || t == TOK_NEWLINE) {
+            p->pos++;
+            p_skip_newlines(p);
+        } else if (t != TOK_EOF && !(end && p_reserved(p, end))) {
+            p_syntax_error(p);
+            return 0;
         }
+    }
+    return 1;
+}
 
-        int ret = 0;
-        if (strcmp(args[0], "cd") == 0)      ret = builtin_cd(args, argc);
-        else if (strcmp(args[0], "pwd") == 0)     ret = builtin_pwd();
-        else if (strcmp(args[0], "echo") == 0)    ret = builtin_echo(args, argc);
-        else if (strcmp(args[0], "export") == 0)  ret = builtin_export(args, argc);
-        else if (strcmp(args[0], "unset") == 0)   ret = builtin_unset(args, argc);
-        else if (strcmp(args[0], "history") == 0) ret = builtin_history(args, argc);
-        else if (strcmp(args[0], "help") == 0)    ret = builtin_help();
-        else if (strcmp(args[0], "alias") == 0)   ret = builtin_alias(args, argc);
-        else if (strcmp(args[0], "unalias") == 0) ret = builtin_unalias(args, argc);
-        else if (strcmp(args[0], "which") == 0)   ret = builtin_which(args, argc);
-        else if (strcmp(args[0], "jobs") == 0)    ret = builtin_jobs();
-        else if (strcmp(args[0], "fg") == 0)      ret = builtin_fg(args, argc);
-        else if (strcmp(args[0], "bg") == 0)      ret = builtin_bg(args, argc);
-        else if (strcmp(args[0], "source") == 0 || strcmp(args[0], ".") == 0)
-            ret = builtin_source(args, argc);
-        else if (strcmp(args[0], "true") == 0)    ret = 0;
-        else if (strcmp(args[0], "false") == 0)   ret = 1;
-        else if (strcmp(args[0], "exit") == 0) {
-            if (saved_stdout >= 0) { dup2(saved_stdout, STDOUT_FILENO); close(saved_stdout); }
-            if (saved_stdin >= 0) { dup2(saved_stdin, STDIN_FILENO); close(saved_stdin); }
-            int code = (argc > 1) ? atoi(args[1]) : last_exit_code;
-            running = 0;
-            return code;
-        } else if (strcmp(args[0], "type") == 0) {
-            for (int i = 1; i < argc; i++) {
-                if (alias_get(args[i])) {
-                    printf("%s is an alias for '%s'\n", args[i], alias_get(args[i]));
-                } else {
-                    const char *builtins[] = {"cd","pwd","echo","export","unset","history",
-                        "help","alias","unalias","which","jobs","fg","bg","source","true","false","exit","type",NULL};
-                    int is_builtin = 0;
-                    for (int j = 0; builtins[j]; j++) {
-                        if (strcmp(args[i], builtins[j]) == 0) {
-                            printf("%s is a shell builtin\n", args[i]);
-                            is_builtin = 1; break;
-                        }
-                    }
-                    if (!is_builtin) {
-                        char *tmp[] = {"which", args[i], NULL};
-                        builtin_which(tmp, 2);
-                    }
+/*
+ * Parse a complete command line into cmd_arena. Returns the AST, or NULL
+ * with *status set to PARSE_ERROR (already reported) or PARSE_INCOMPLETE.
+ */
+CmdList *parse_line(const char *line, int *status) {
+    TokenList tl = {0};
+    if (lex_line(line, &tl) != LEX_OK) {
+        *status = PARSE_INCOMPLETE;
+        return NULL;
+    }
+    CmdList *l = arena_alloc(&cmd_arena, sizeof(CmdList));
+    Parser p = { tl.toks, tl.count, 0, 0, -1 };
+    parse_list(&p, l, NULL);
+    *status = p.error;
+    return *status == PARSE_OK ? l : NULL;
+}
+
+/* ===== Expansion ===== */
+/* Look up ${name} / $name where name is tok[start, end) */
+static const char *expand_var(const char *tok, int start, int end) {
+    return var_get(arena_strndup(&cmd_arena, tok + start, end - start));
+}
+
+static void command_subst(const char *cmd, StrBuf *out);
+
+/*
+ * Fields go on to pathname expansion, which must not treat quoted * ? [
+ * as wildcards. In fields, those and every literal backslash carry a
+ * backslash escape; expand_globs() removes them again.
+ */
+static void put_quoted(StrBuf *buf, ArgVec *fields, const char *s, size_t n) {
+    if (!fields) {
+        sb_putn(buf, s, n);
+        return;
+    }
+    size_t start = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] != '*' && s[i] != '?' && s[i] != '[' && s[i] != '\\') continue;
+        sb_putn(buf, s + start, i - start);
+        sb_putc(buf, '\\');
+        start = i;
+    }
+    sb_putn(buf, s + start, n - start);
+}
+
+/*
+ * Append the result of a $-expansion. Outside double quotes, and when the
+ * caller asked for fields, blanks in the result separate fields.
+ */
+static void put_expansion(StrBuf *buf, int *started, ArgVec *fields, int quoted,
+                          const char *text, size_t n) {
+    if (!fields || quoted) {
+        put_quoted(buf, fields, text, n);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        char c = text[i];
+        if (c == ' ' || c == '\t' || c == '\n') {
+            if (*started) {
+                av_push(fields, buf->s);
+                memset(buf, 0, sizeof(*buf));
+                *started = 0;
+            }
+        } else {
+            /* Unquoted results still glob, but a backslash in them is data */
+            if (c == '\\') sb_putc(buf, '\\');
+            sb_putc(buf, c);
+            *started = 1;
+        }
+    }
+}
+
+/*
+ * Expand variables, $(...), ~ and quotes in a raw word; results live in
+ * cmd_arena and have no length limit. With `fields` set, unquoted
+ * expansion results are split into separate fields and a word that
+ * expands to nothing unquoted produces no field at all.
+ */
+static char *expand_word(const char *tok, ArgVec *fields) {
+    StrBuf buf = {0};
+    int started = 0;        /* current field has content or quotes */
+    int ti = 0;
+    int len = strlen(tok);
+    int in_double = 0;
+
+    while (ti < len) {
+        if (tok[ti] == '\'' && !in_double) {
+            /* Single quotes: everything literal up to the closing quote */
+            const char *q = strchr(tok + ti + 1, '\'');
+            int end = q ? (int)(q - tok) : len;
+            put_quoted(&buf, fields, tok + ti + 1, end - ti - 1);
+            ti = q ? end + 1 : len;
+            started = 1;
+        } else if (tok[ti] == '"') {
+            in_double = !in_double;
+            ti++;
+            started = 1;
+        } else if (tok[ti] == '\\' && tok[ti+1]) {
+            /* Inside double quotes only \$ \" \\ \` lose their backslash */
+            if (!in_double || strchr("$\"\\`", tok[ti+1])) ti++;
+            put_quoted(&buf, fields, tok + ti++, 1);
+            started = 1;
+        } else if (tok[ti] == '$') {
+            ti++;
+            const char *val = NULL;
+            char num[16];
+            if (tok[ti] == '{') {
+                int start = ++ti;
+                while (tok[ti] && tok[ti] != '}') ti++;
+                val = expand_var(tok, start, ti);
+                if (tok[ti] == '}') ti++;
+            } else if (tok[ti] == '(') {
+                /* Command substitution $(...) */
+                int end = scan_subst(tok, ti + 1);
+                if (end < 0) end = len + 1;
+                char *cmd = arena_strndup(&cmd_arena, tok + ti + 1, end - 1 - (ti + 1));
+                ti = end > len ? len : end;
+                StrBuf out = {0};
+                command_subst(cmd, &out);
+                put_expansion(&buf, &started, fields, in_double, out.s ? out.s : "", out.len);
+                continue;
+            } else if (tok[ti] == '?') {
+                ti++;
+                snprintf(num, sizeof(num), "%d", last_exit_code);
+                val = num;
+            } else if (tok[ti] == '$') {
+                ti++;
+                snprintf(num, sizeof(num), "%d", getpid());
+                val = num;
+            } else if (isalpha((unsigned char)tok[ti]) || tok[ti] == '_') {
+                int start = ti;
+                while (isalnum((unsigned char)tok[ti]) || tok[ti] == '_') ti++;
+                val = expand_var(tok, start, ti);
+            } else {
+                /* A lone '$' stays literal */
+                sb_putc(&buf, '$');
+                started = 1;
+                continue;
+            }
+            if (val) put_expansion(&buf, &started, fields, in_double, val, strlen(val));
+        } else if (tok[ti] == '~' && ti == 0 && (tok[1] == '\0' || tok[1] == '/')) {
+            ti++;
+            const char *home = var_get("HOME");
+            if (!home) home = "~";
+            put_quoted(&buf, fields, home, strlen(home));
+            started = 1;
+        } else {
+            /* Copy a run of ordinary characters at once */
+            int start = ti;
+            while (ti < len && !strchr("'\"\\$", tok[ti])) ti++;
+            if (ti == start) ti++;
+            if (in_double) put_quoted(&buf, fields, tok + start, ti - start);
+            else sb_putn(&buf, tok + start, ti - start);
+            started = 1;
+        }
+    }
+    if (!buf.s) sb_putn(&buf, "", 0);
+    if (fields && started) av_push(fields, buf.s);
+    return buf.s;
+}
+
+/* Expand a word to exactly one string (assignments, redirection targets) */
+char *expand_token(const char *tok) {
+    if (!tok) return NULL;
+    return expand_word(tok, NULL);
+}
+
+/* ===== Brace Expansion ===== */
+/*
+ * `pre{a,b}post` and `pre{1..10..2}post` are expanded on the raw word,
+ * before any other expansion, and lazily: a BraceIter hands out one word
+ * at a time, so `for i in {1..1000000}` never holds the whole list.
+ * Each level of the iterator is a word with its first brace group found;
+ * the current alternative spliced into it is checked for further groups
+ * and pushed as the next level. Quoted braces, ${...} and $(...) are
+ * never expanded, and a group without a comma or a valid range is left
+ * as it is.
+ */
+#define BRACE_DEPTH 32
+
+typedef struct {
+    char *word;             /* malloc'd */
+    size_t open, close;     /* offsets of the group's '{' and '}' */
+    int range;
+    size_t next;            /* list: start of the next alternative, 0 when done */
+    long long cur, end, step;
+    int width;              /* zero-padded ranges */
+    int letters;            /* {a..z} */
+} BraceLevel;
+
+typedef struct {
+    BraceLevel lv[BRACE_DEPTH];
+    int n;
+    char *plain;            /* word without a group, handed out once */
+    char *out;              /* last word returned */
+} BraceIter;
+
+/* Skip a quoted run or $-expansion at w[i]; returns the index after it */
+static size_t brace_skip(const char *w, size_t i) {
+    if (w[i] == '\\') return w[i+1] ? i + 2 : i + 1;
+    if (w[i] == '\'') {
+        const char *q = strchr(w + i + 1, '\'');
+        return q ? (size_t)(q - w) + 1 : strlen(w);
+    }
+    if (w[i] == '"') {
+        for (i++; w[i] && w[i] != '"'; i++)
+            if (w[i] == '\\' && w[i+1]) i++;
+        return w[i] ? i + 1 : i;
+    }
+    if (w[i] == '$' && w[i+1] == '{') {
+        const char *q = strchr(w + i, '}');
+        return q ? (size_t)(q - w) + 1 : strlen(w);
+    }
+    if (w[i] == '$' && w[i+1] == '(') {
+        int end = scan_subst(w, i + 2);
+        return end < 0 ? strlen(w) : (size_t)end;
+    }
+    return i + 1;
+}
+
+static int brace_endpoint(const char *s, size_t n, long long *v, int *width, int *letter) {
+    if (n == 1 && isalpha((unsigned char)s[0])) {
+        *v = (unsigned char)s[0];
+        *letter = 1;
+        return 1;
+    }
+    size_t i = (n > 0 && (s[0] == '-' || s[0] == '+')) ? 1 : 0;
+    if (i == n) return 0;
+    for (size_t k = i; k < n; k++)
+        if (!isdigit((unsigned char)s[k])) return 0;
+    *v = strtoll(s, NULL, 10);
+    *letter = 0;
+    if (s[i] == '0' && n - i > 1) *width = n;
+    return 1;
+}
+
+static const char *brace_dots(const char *s, const char *e) {
+    for (; s + 1 < e; s++)
+        if (s[0] == '.' && s[1] == '.') return s;
+    return NULL;
+}
+
+/* Parse {x..y[..step]} between open and close into l */
+static int brace_range(BraceLevel *l) {
+    const char *s = l->word + l->open + 1;
+    const char *e2 = l->word + l->close;
+    const char *d1 = brace_dots(s, e2);
+    if (!d1) return 0;
+    const char *d2 = brace_dots(d1 + 2, e2);
+    long long a, b, step = 1;
+    int wa = 0, wb = 0, la, lb, ls;
+    if (!brace_endpoint(s, d1 - s, &a, &wa, &la) ||
+        !brace_endpoint(d1 + 2, (d2 ? d2 : e2) - d1 - 2, &b, &wb, &lb) || la != lb)
+        return 0;
+    if (d2) {
+        int ws = 0;
+        if (!brace_endpoint(d2 + 2, e2 - d2 - 2, &step, &ws, &ls) || ls) return 0;
+        if (step < 0) step = -step;
+        if (step == 0) step = 1;
+    }
+    l->range = 1;
+    l->letters = la;
+    l->width = wa > wb ? wa : wb;
+    l->cur = a;
+    l->end = b;
+    l->step = a <= b ? step : -step;
+    return 1;
+}
+
+/* Find the first expandable group in l->word; 0 if there is none */
+static int brace_find(BraceLevel *l) {
+    const char *w = l->word;
+    size_t i = 0;
+    while (w[i]) {
+        if (w[i] != '{') {
+            i = brace_skip(w, i);
+            continue;
+        }
+        int depth = 0, comma = 0;
+        size_t j = i;
+        while (w[j]) {
+            if (w[j] == '{') depth++;
+            else if (w[j] == '}' && --depth == 0) break;
+            else if (w[j] == ',' && depth == 1) comma = 1;
+            if (w[j] == '{' || w[j] == '}' || w[j] == ',') j++;
+            else j = brace_skip(w, j);
+        }
+        if (!w[j]) return 0;
+        l->open = i;
+        l->close = j;
+        l->range = 0;
+        if (comma) {
+            l->next = i + 1;
+            return 1;
+        }
+        if (brace_range(l)) return 1;
+        i++;
+    }
+    return 0;
+}
+
+/* Point alt/altlen at the next alternative of l (ranges format into buf); 0 when done */
+static int brace_alt(BraceLevel *l, char *buf, const char **alt, size_t *altlen) {
+    if (l->range) {
+        if (l->step > 0 ? l->cur > l->end : l->cur < l->end) return 0;
+        if (l->letters) {
+            buf[0] = (char)l->cur;
+            buf[1] = '\0';
+        } else {
+            snprintf(buf, 32, l->cur < 0 ? "-%0*lld" : "%0*lld",
+                     l->width - (l->cur < 0), l->cur < 0 ? -l->cur : l->cur);
+        }
+        *alt = buf;
+        *altlen = strlen(buf);
+        if ((l->step > 0 && l->cur > LLONG_MAX - l->step) ||
+            (l->step < 0 && l->cur < LLONG_MIN - l->step))
+            l->end = l->step > 0 ? LLONG_MIN : LLONG_MAX;
+        else
+            l->cur += l->step;
+        return 1;
+    }
+    if (!l->next) return 0;
+    const char *w = l->word;
+    size_t i = l->next;
+    int depth = 0;
+    while (i < l->close && !(depth == 0 && w[i] == ',')) {
+        if (w[i] == '{') depth++;
+        else if (w[i] == '}') depth--;
+        if (w[i] == '{' || w[i] == '}') i++;
+        else i = brace_skip(w, i);
+    }
+    *alt = w + l->next;
+    *altlen = i - l->next;
+    l->next = i < l->close ? i + 1 : 0;
+    return 1;
+}
+
+static int brace_push(BraceIter *it, char *word) {
+    BraceLevel *l = &it->lv[it->n];
+    memset(l, 0, sizeof(*l));
+    l->word = word;
+    if (it->n == BRACE_DEPTH || !brace_find(l)) return 0;
+    it->n++;
+    return 1;
+}
+
+static void brace_start(BraceIter *it, const char *word) {
+    it->n = 0;
+    it->out = NULL;
+    it->plain = NULL;
+    char *w = strdup(word);
+    if (!strchr(w, '{') || !brace_push(it, w)) it->plain = w;
+}
+
+/* Next word, valid until the following call; NULL at the end */
+static const char *brace_next(BraceIter *it) {
+    free(it->out);
+    it->out = NULL;
+    if (it->plain) {
+        it->out = it->plain;
+        it->plain = NULL;
+        return it->out;
+    }
+    while (it->n > 0) {
+        BraceLevel *l = &it->lv[it->n - 1];
+        char num[32];
+        const char *alt;
+        size_t altlen;
+        if (!brace_alt(l, num, &alt, &altlen)) {
+            free(l->word);
+            it->n--;
+            continue;
+        }
+        size_t tail = strlen(l->word + l->close + 1);
+        char *w = malloc(l->open + altlen + tail + 1);
+        memcpy(w, l->word, l->open);
+        memcpy(w + l->open, alt, altlen);
+        memcpy(w + l->open + altlen, l->word + l->close + 1, tail + 1);
+        if (!brace_push(it, w)) {
+            it->out = w;
+            return w;
+        }
+    }
+    return NULL;
+}
+
+static void brace_free(BraceIter *it) {
+    while (it->n > 0) free(it->lv[--it->n].word);
+    free(it->plain);
+    free(it->out);
+    it->plain = it->out = NULL;
+}
+
+/* ===== Built-in Commands ===== */
+
+/* cd */
+int builtin_cd(char **args, int argc) {
+    const char *target;
+    if (argc < 2 || args[1] == NULL) {
+        target = var_get("HOME");
+        if (!target) target = "/";
+    } else if (strcmp(args[1], "-") == 0) {
+        target = var_get("OLDPWD");
+        if (!target) {
+            fprintf(stderr, "xsh: cd: OLDPWD not set\n");
+            return 1;
+        }
+        printf("%s\n", target);
+    } else {
+        target = args[1];
+    }
+
+    char old[MAX_PATH];
+    getcwd(old, sizeof(old));
+
+    if (chdir(target) != 0) {
+        fprintf(stderr, FGRGB(255,80,80) "✗" RESET " xsh: cd: %s: %s\n", target, strerror(errno));
+        return 1;
+    }
+
+    var_set("OLDPWD", old, VAR_EXPORT);
+    getcwd(cwd, sizeof(cwd));
+    var_set("PWD", cwd, VAR_EXPORT);
+    return 0;
+}
+
+/* pwd */
+int builtin_pwd(char **args, int argc) {
+    (void)args; (void)argc;
+    getcwd(cwd, sizeof(cwd));
+    printf(FGRGB(0,255,180) "%s\n" RESET, cwd);
+    return 0;
+}
+
+/* echo */
+int builtin_echo(char **args, int argc) {
+    int newline = 1;
+    int start = 1;
+
+    if (argc > 1 && strcmp(args[1], "-n") == 0) {
+        newline = 0;
+        start = 2;
+    }
+
+    for (int i = start; i < argc; i++) {
+        if (i > start) printf(" ");
+        /* Handle escape sequences */
+        const char *s = args[i];
+        while (*s) {
+            if (*s == '\\' && *(s+1)) {
+                s++;
+                switch (*s) {
+                    case 'n': printf("\n"); break;
+                    case 't': printf("\t"); break;
+                    case 'r': printf("\r"); break;
+                    case 'e': printf("\033"); break;
+                    case '\\': printf("\\"); break;
+                    default: printf("\\%c", *s); break;
+                }
+            } else {
+                putchar(*s);
+            }
+            s++;
+        }
+    }
+    if (newline) printf("\n");
+    return 0;
+}
+
+/* export */
+int builtin_export(char **args, int argc) {
+    if (argc < 2) {
+        /* Print the exported variables */
+        char **env = var_envp();
+        for (int i = 0; env[i]; i++) {
+            printf(FGRGB(0,200,255) "export " RESET "%s\n", env[i]);
+        }
+        return 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        char *eq = strchr(args[i], '=');
+        if (eq) {
+            char *varname = arena_strndup(&cmd_arena, args[i], eq - args[i]);
+            var_set(varname, eq + 1, VAR_EXPORT);
+        } else {
+            var_export(args[i]);
+        }
+    }
+    return 0;
+}
+
+/* unset */
+int builtin_unset(char **args, int argc) {
+    for (int i = 1; i < argc; i++) {
+        var_unset(args[i]);
+    }
+    return 0;
+}
+
+/* history - forward declaration, implemented after custom readline */
+int builtin_history(char **args, int argc);
+
+/* ===== Alias System ===== */
+/*
+ * Aliases are hashed by name; aliases[] keeps them in definition order
+ * for listings. Each body is lexed once, here, and the parser splices
+ * the tokens in (see p_expand_alias).
+ */
+#define ALIAS_BUCKETS 512
+
+static Alias *alias_table[ALIAS_BUCKETS];
+static Alias **aliases;
+static int alias_count = 0;
+static int alias_cap = 0;
+
+static Alias *alias_find(const char *name) {
+    for (Alias *a = alias_table[str_hash(name) % ALIAS_BUCKETS]; a; a = a->next)
+        if (strcmp(a->name, name) == 0) return a;
+    return NULL;
+}
+
+/* Lex the body into malloc'd tokens; an incomplete body leaves toks NULL */
+static void alias_compile(Alias *a) {
+    size_t vl = strlen(a->value);
+    a->blank = vl > 0 && (a->value[vl-1] == ' ' || a->value[vl-1] == '\t');
+    a->toks = NULL;
+    a->ntoks = 0;
+    ArenaMark mark = arena_mark(&cmd_arena);
+    TokenList tl = {0};
+    if (lex_line(a->value, &tl) == LEX_OK) {
+        a->ntoks = tl.count - 1;
+        a->toks = malloc((a->ntoks + 1) * sizeof(Token));
+        for (int i = 0; i < a->ntoks; i++) {
+            a->toks[i] = tl.toks[i];
+            if (tl.toks[i].text) a->toks[i].text = strdup(tl.toks[i].text);
+        }
+    }
+    arena_release(&cmd_arena, mark);
+}
+
+static void alias_free_body(Alias *a) {
+    for (int i = 0; a->toks && i < a->ntoks; i++) free(a->toks[i].text);
+    free(a->toks);
+    free(a->value);
+}
+
+void alias_set(const char *name, const char *value) {
+    Alias *a = alias_find(name);
+    if (a) {
+        alias_free_body(a);
+    } else {
+        if (alias_count == alias_cap) {
+            alias_cap = alias_cap ? alias_cap * 2 : 64;
+            aliases = realloc(aliases, alias_cap * sizeof(Alias*));
+        }
+        a = malloc(sizeof(Alias));
+        a->name = strdup(name);
+        unsigned int h = str_hash(name) % ALIAS_BUCKETS;
+        a->next = alias_table[h];
+        alias_table[h] = a;
+        a->index = alias_count;
+        aliases[alias_count++] = a;
+    }
+    a->value = strdup(value);
+    alias_compile(a);
+}
+
+const char *alias_get(const char *name) {
+    Alias *a = alias_find(name);
+    return a ? a->value : NULL;
+}
+
+void alias_remove(const char *name) {
+    Alias **pp = &alias_table[str_hash(name) % ALIAS_BUCKETS];
+    while (*pp && strcmp((*pp)->name, name) != 0) pp = &(*pp)->next;
+    Alias *a = *pp;
+    if (!a) return;
+    *pp = a->next;
+    /* Shift the rest down: listings and rc snapshots keep definition order */
+    alias_count--;
+    for (int i = a->index; i < alias_count; i++) {
+        aliases[i] = aliases[i + 1];
+        aliases[i]->index = i;
+    }
+    alias_free_body(a);
+    free(a->name);
+    free(a);
+}
+
+int builtin_alias(char **args, int argc) {
+    if (argc < 2) {
+        for (int i = 0; i < alias_count; i++) {
+            printf(FGRGB(0,200,255) "alias " RESET "%s=" FGRGB(0,255,150) "'%s'\n" RESET,
+                   aliases[i]->name, aliases[i]->value);
+        }
+        return 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        char *eq = strchr(args[i], '=');
+        if (eq) {
+            char *name = arena_strndup(&cmd_arena, args[i], eq - args[i]);
+            /* Strip surrounding quotes from value */
+            char *val = eq + 1;
+            int vlen = strlen(val);
+            if (vlen >= 2 && ((val[0] == '\'' && val[vlen-1] == '\'') ||
+                               (val[0] == '"' && val[vlen-1] == '"'))) {
+                char *tmp = strndup(val + 1, vlen - 2);
+                alias_set(name, tmp);
+                free(tmp);
+            } else {
+                alias_set(name, val);
+            }
+        } else {
+            const char *v = alias_get(args[i]);
+            if (v) {
+                printf(FGRGB(0,200,255) "alias " RESET "%s=" FGRGB(0,255,150) "'%s'\n" RESET, args[i], v);
+            } else {
+                fprintf(stderr, "xsh: alias: %s: not found\n", args[i]);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int builtin_unalias(char **args, int argc) {
+    for (int i = 1; i < argc; i++) {
+        alias_remove(args[i]);
+    }
+    return 0;
+}
+
+/* ===== Command Hash Table ===== */
+/*
+ * Remembers where each external command was found on $PATH so repeated
+ * invocations skip the directory walk. The table is dropped whenever
+ * $PATH changes, and a cached entry that is no longer executable is
+ * evicted and searched for again.
+ */
+#define CMDHASH_BUCKETS 256
+
+typedef struct CmdHashEntry {
+    char *name;
+    char *path;
+    int hits;
+    struct CmdHashEntry *next;
+} CmdHashEntry;
+
+static CmdHashEntry *cmdhash_table[CMDHASH_BUCKETS];
+static char *cmdhash_path_env = NULL; /* $PATH the table was built against */
+
+void cmdhash_clear(void) {
+    for (int i = 0; i < CMDHASH_BUCKETS; i++) {
+        CmdHashEntry *e = cmdhash_table[i];
+        while (e) {
+            CmdHashEntry *next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            e = next;
+        }
+        cmdhash_table[i] = NULL;
+    }
+}
+
+/* Drop the table if $PATH differs from the one it was built against */
+static void cmdhash_check_path(void) {
+    const char *path_env = var_get("PATH");
+    if (!path_env) path_env = "";
+    if (cmdhash_path_env && strcmp(cmdhash_path_env, path_env) == 0) return;
+    cmdhash_clear();
+    free(cmdhash_path_env);
+    cmdhash_path_env = strdup(path_env);
+}
+
+/* Walk $PATH for name; returns a malloc'd absolute path or NULL */
+static char *path_search(const char *name) {
+    const char *dir = cmdhash_path_env;
+    if (!dir || !*name) return NULL;
+    while (1) {
+        const char *end = strchr(dir, ':');
+        int dlen = end ? (int)(end - dir) : (int)strlen(dir);
+        char full[MAX_PATH];
+        if (dlen == 0)
+            snprintf(full, sizeof(full), "./%s", name);
+        else
+            snprintf(full, sizeof(full), "%.*s/%s", dlen, dir, name);
+        struct stat st;
+        if (access(full, X_OK) == 0 && stat(full, &st) == 0 && S_ISREG(st.st_mode))
+            return strdup(full);
+        if (!end) break;
+        dir = end + 1;
+    }
+    return NULL;
+}
+
+/*
+ * Resolve a command name to an executable path. Names containing a slash
+ * are returned unchanged. The returned string is owned by the table and
+ * stays valid until the next hash operation.
+ */
+const char *cmdhash_lookup(const char *name) {
+    if (!name || !*name) return NULL;
+    if (strchr(name, '/')) return name;
+
+    cmdhash_check_path();
+
+    unsigned int b = str_hash(name) % CMDHASH_BUCKETS;
+    CmdHashEntry **link = &cmdhash_table[b];
+    for (CmdHashEntry *e = *link; e; link = &e->next, e = e->next) {
+        if (strcmp(e->name, name) != 0) continue;
+        if (access(e->path, X_OK) == 0) {
+            e->hits++;
+            return e->path;
+        }
+        /* Cached binary disappeared: evict and search again */
+        *link = e->next;
+        free(e->name);
+        free(e->path);
+        free(e);
+        break;
+    }
+
+    char *found = path_search(name);
+    if (!found) return NULL;
+    CmdHashEntry *e = malloc(sizeof(CmdHashEntry));
+    e->name = strdup(name);
+    e->path = found;
+    e->hits = 1;
+    e->next = cmdhash_table[b];
+    cmdhash_table[b] = e;
+    return e->path;
+}
+
+/* hash [-r] [name...] */
+int builtin_hash(char **args, int argc) {
+    if (argc < 2) {
+        cmdhash_check_path();
+        int any = 0;
+        for (int i = 0; i < CMDHASH_BUCKETS; i++) {
+            for (CmdHashEntry *e = cmdhash_table[i]; e; e = e->next) {
+                if (!any) printf(FGRGB(0,200,255) "hits    name\tpath\n" RESET);
+                printf("%4d    %s\t" FGRGB(0,255,150) "%s\n" RESET, e->hits, e->name, e->path);
+                any = 1;
+            }
+        }
+        if (!any) printf("xsh: hash: hash table empty\n");
+        return 0;
+    }
+    int ret = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(args[i], "-r") == 0) {
+            cmdhash_clear();
+            continue;
+        }
+        if (!cmdhash_lookup(args[i])) {
+            fprintf(stderr, "xsh: hash: %s: not found\n", args[i]);
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+/* ===== Executable Index ===== */
+/*
+ * Command-name completion reads a sorted, de-duplicated list of the
+ * executables on $PATH instead of scanning the directories on every Tab.
+ * Each query costs one stat() per PATH directory; a directory is read
+ * again only when it is replaced or its mtime moves, and the whole index
+ * is dropped when PATH itself changes.
+ */
+typedef struct {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    long mtime_ns;
+    int scanned;
+    char **names;
+    int n;
+} ExecDir;
+
+static ExecDir *exec_dirs;
+static int exec_ndirs;
+static char *exec_path_env;
+static char **exec_names;       /* sorted, unique; strings owned by exec_dirs */
+static int exec_nnames;
+
+static int str_compare(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static long stat_mtime_ns(const struct stat *st) {
+#if defined(__linux__)
+    return st->st_mtim.tv_nsec;
+#else
+    (void)st;
+    return 0;
+#endif
+}
+
+static void exec_dir_clear(ExecDir *ed) {
+    for (int i = 0; i < ed->n; i++) free(ed->names[i]);
+    free(ed->names);
+    ed->names = NULL;
+    ed->n = 0;
+    ed->scanned = 0;
+}
+
+static void exec_dir_scan(ExecDir *ed, const struct stat *st) {
+    exec_dir_clear(ed);
+    ed->scanned = 1;
+    ed->dev = st->st_dev;
+    ed->ino = st->st_ino;
+    ed->mtime = st->st_mtime;
+    ed->mtime_ns = stat_mtime_ns(st);
+
+    DIR *d = opendir(ed->path);
+    if (!d) return;
+    int cap = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+        const char *nm = ent->d_name;
+        if (nm[0] == '.' && (!nm[1] || (nm[1] == '.' && !nm[2]))) continue;
+#ifdef DT_DIR
+        if (ent->d_type == DT_DIR) continue;
+#endif
+        if (faccessat(dirfd(d), nm, X_OK, 0) != 0) continue;
+        if (ed->n == cap) {
+            cap = cap ? cap * 2 : 64;
+            ed->names = realloc(ed->names, cap * sizeof(char*));
+        }
+        ed->names[ed->n++] = strdup(nm);
+    }
+    closedir(d);
+}
+
+static void exec_index_refresh(void) {
+    const char *path_env = var_get("PATH");
+    if (!path_env) path_env = "";
+    int changed = 0;
+
+    if (!exec_path_env || strcmp(exec_path_env, path_env) != 0) {
+        for (int i = 0; i < exec_ndirs; i++) {
+            exec_dir_clear(&exec_dirs[i]);
+            free(exec_dirs[i].path);
+        }
+        free(exec_dirs);
+        free(exec_path_env);
+        exec_path_env = strdup(path_env);
+        exec_ndirs = 1;
+        for (const char *p = path_env; *p; p++) exec_ndirs += *p == ':';
+        exec_dirs = calloc(exec_ndirs, sizeof(ExecDir));
+        const char *dir = path_env;
+        for (int i = 0; i < exec_ndirs; i++) {
+            const char *end = strchr(dir, ':');
+            int dlen = end ? (int)(end - dir) : (int)strlen(dir);
+            exec_dirs[i].path = dlen ? strndup(dir, dlen) : strdup(".");
+            dir = end ? end + 1 : dir + dlen;
+        }
+        changed = 1;
+    }
+
+    for (int i = 0; i < exec_ndirs; i++) {
+        ExecDir *ed = &exec_dirs[i];
+        struct stat st;
+        if (stat(ed->path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            if (ed->scanned) {
+                exec_dir_clear(ed);
+                changed = 1;
+            }
+            continue;
+        }
+        if (!ed->scanned || ed->dev != st.st_dev || ed->ino != st.st_ino ||
+            ed->mtime != st.st_mtime || ed->mtime_ns != stat_mtime_ns(&st)) {
+            exec_dir_scan(ed, &st);
+            changed = 1;
+        }
+    }
+    if (!changed) return;
+
+    int total = 0;
+    for (int i = 0; i < exec_ndirs; i++) total += exec_dirs[i].n;
+    exec_names = realloc(exec_names, (total + 1) * sizeof(char*));
+    int n = 0;
+    for (int i = 0; i < exec_ndirs; i++)
+        for (int j = 0; j < exec_dirs[i].n; j++) exec_names[n++] = exec_dirs[i].names[j];
+    qsort(exec_names, n, sizeof(char*), str_compare);
+    exec_nnames = 0;
+    for (int i = 0; i < n; i++)
+        if (exec_nnames == 0 || strcmp(exec_names[exec_nnames - 1], exec_names[i]) != 0)
+            exec_names[exec_nnames++] = exec_names[i];
+}
+
+/* Executables starting with prefix: *first gets the index, returns the count */
+static int exec_index_match(const char *prefix, size_t plen, int *first) {
+    exec_index_refresh();
+    int lo = 0, hi = exec_nnames;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strncmp(exec_names[mid], prefix, plen) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    int end = lo;
+    while (end < exec_nnames && strncmp(exec_names[end], prefix, plen) == 0) end++;
+    *first = lo;
+    return end - lo;
+}
+
+/* ===== Directory Listing Cache ===== */
+/*
+ * File completion reads directories incrementally. Each Tab spends at
+ * most XSH_COMPLETE_MS milliseconds (default 50) in readdir() and keeps
+ * the DIR open, so the next Tab in the same directory carries on where
+ * the last one stopped instead of blocking on a huge listing. Listings
+ * stay cached while the directory's identity and mtime are unchanged;
+ * the last few directories are remembered.
+ */
+#define DIRCACHE_SLOTS 4
+
+typedef struct {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    long mtime_ns;
+    DIR *d;                 /* open while the listing is incomplete */
+    char **names;           /* directories carry a trailing '/' */
+    int n, cap;
+    int complete;
+    unsigned long used;     /* LRU stamp */
+} DirCache;
+
+static DirCache dircache[DIRCACHE_SLOTS];
+static unsigned long dircache_clock;
+
+static long long clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void dircache_drop(DirCache *dc) {
+    if (dc->d) closedir(dc->d);
+    for (int i = 0; i < dc->n; i++) free(dc->names[i]);
+    free(dc->names);
+    free(dc->path);
+    memset(dc, 0, sizeof(*dc));
+}
+
+static void dircache_add(DirCache *dc, const char *name, int is_dir) {
+    if (dc->n == dc->cap) {
+        dc->cap = dc->cap ? dc->cap * 2 : 256;
+        dc->names = realloc(dc->names, dc->cap * sizeof(char*));
+    }
+    size_t nl = strlen(name);
+    char *e = malloc(nl + 2);
+    memcpy(e, name, nl);
+    if (is_dir) e[nl++] = '/';
+    e[nl] = '\0';
+    dc->names[dc->n++] = e;
+}
+
+/* Listing of `path`, read further for up to budget_ms; NULL if unreadable */
+static DirCache *dircache_get(const char *path, int budget_ms) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) return NULL;
+
+    DirCache *dc = NULL, *victim = &dircache[0];
+    for (int i = 0; i < DIRCACHE_SLOTS; i++) {
+        if (dircache[i].path && strcmp(dircache[i].path, path) == 0) {
+            dc = &dircache[i];
+            break;
+        }
+        if (dircache[i].used < victim->used) victim = &dircache[i];
+    }
+    if (dc && (dc->dev != st.st_dev || dc->ino != st.st_ino || dc->mtime != st.st_mtime ||
+               dc->mtime_ns != stat_mtime_ns(&st))) {
+        victim = dc;
+        dc = NULL;
+    }
+    if (!dc) {
+        dc = victim;
+        dircache_drop(dc);
+        if (!(dc->d = opendir(path))) return NULL;
+        dc->path = strdup(path);
+        dc->dev = st.st_dev;
+        dc->ino = st.st_ino;
+        dc->mtime = st.st_mtime;
+        dc->mtime_ns = stat_mtime_ns(&st);
+    }
+    dc->used = ++dircache_clock;
+    if (dc->complete) return dc;
+
+    long long deadline = clock_ms() + budget_ms;
+    struct dirent *ent;
+    int k = 0;
+    while ((ent = readdir(dc->d))) {
+        const char *nm = ent->d_name;
+        if (nm[0] == '.' && (!nm[1] || (nm[1] == '.' && !nm[2]))) continue;
+        int is_dir = 0;
+#ifdef DT_DIR
+        if (ent->d_type == DT_DIR) is_dir = 1;
+        else if (ent->d_type == DT_UNKNOWN || ent->d_type == DT_LNK)
+#endif
+        {
+            struct stat es;
+            is_dir = fstatat(dirfd(dc->d), nm, &es, 0) == 0 && S_ISDIR(es.st_mode);
+        }
+        dircache_add(dc, nm, is_dir);
+        if ((++k & 255) == 0 && clock_ms() >= deadline) break;
+    }
+    if (!ent) {
+        dc->complete = 1;
+        closedir(dc->d);
+        dc->d = NULL;
+    }
+    return dc;
+}
+
+static int complete_budget_ms(void) {
+    const char *v = var_get("XSH_COMPLETE_MS");
+    return v && atoi(v) > 0 ? atoi(v) : 50;
+}
+
+/* ===== which / type ===== */
+/* cmdhash_lookup() has already checked PATH results; only a name with a '/' is unchecked */
+static const char *resolve_command(const char *name) {
+    const char *full = cmdhash_lookup(name);
+    if (full && strchr(name, '/') && access(full, X_OK) != 0) return NULL;
+    return full;
+}
+
+int builtin_which(char **args, int argc) {
+    int ret = 0;
+    for (int i = 1; i < argc; i++) {
+        const char *full = resolve_command(args[i]);
+        if (full) {
+            printf(FGRGB(0,255,150) "%s\n" RESET, full);
+        } else {
+            fprintf(stderr, "xsh: which: %s: not found\n", args[i]);
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+/* ===== Job Control ===== */
+#define MAX_JOBS 64
+typedef struct {
+    pid_t pid;
+    int job_id;
+    char cmd[256];
+    int running;
+} Job;
+
+static Job jobs[MAX_JOBS];
+static int job_count = 0;
+static int next_job_id = 1;
+
+Job *job_add(pid_t pid, const char *cmd) {
+    if (job_count >= MAX_JOBS) return NULL;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].pid == 0) {
+            jobs[i].pid = pid;
+            jobs[i].job_id = next_job_id++;
+            strncpy(jobs[i].cmd, cmd, 255);
+            jobs[i].running = 1;
+            job_count++;
+            return &jobs[i];
+        }
+    }
+    return NULL;
+}
+
+void job_remove(pid_t pid) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].pid == pid) {
+            jobs[i].pid = 0;
+            jobs[i].running = 0;
+            job_count--;
+            return;
+        }
+    }
+}
+
+void sigchld_handler(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    for (int i = 0; i < MAX_JOBS; i++)
+        if (jobs[i].pid != 0 && jobs[i].running && waitpid(jobs[i].pid, NULL, WNOHANG) == jobs[i].pid)
+            jobs[i].running = 0;
+    errno = saved_errno;
+}
+
+int builtin_jobs(char **args, int argc) {
+    (void)args; (void)argc;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].pid != 0) {
+            int status;
+            int r = jobs[i].running ? waitpid(jobs[i].pid, &status, WNOHANG) : jobs[i].pid;
+            if (r == jobs[i].pid) {
+                /* Job finished */
+                printf("[%d] Done     %s\n", jobs[i].job_id, jobs[i].cmd);
+                job_remove(jobs[i].pid);
+            } else {
+                printf(FGRGB(0,200,255) "[%d]" RESET " Running   " FGRGB(200,200,200) "%s\n" RESET,
+                       jobs[i].job_id, jobs[i].cmd);
+            }
+        }
+    }
+    return 0;
+}
+
+int builtin_fg(char **args, int argc) {
+    if (job_count == 0) {
+        fprintf(stderr, "xsh: fg: no current job\n");
+        return 1;
+    }
+    int jid = (argc > 1) ? atoi(args[1]) : -1;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].pid != 0 && (jid == -1 || jobs[i].job_id == jid)) {
+            kill(jobs[i].pid, SIGCONT);
+            int status = 0;
+            if (jobs[i].running) waitpid(jobs[i].pid, &status, 0);
+            job_remove(jobs[i].pid);
+            return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+        }
+    }
+    fprintf(stderr, "xsh: fg: job not found\n");
+    return 1;
+}
+
+int builtin_bg(char **args, int argc) {
+    int jid = (argc > 1) ? atoi(args[1]) : -1;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].pid != 0 && (jid == -1 || jobs[i].job_id == jid)) {
+            kill(jobs[i].pid, SIGCONT);
+            jobs[i].running = 1;
+            printf("[%d] %d %s\n", jobs[i].job_id, jobs[i].pid, jobs[i].cmd);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* ===== Source file ===== */
+/* Forward declaration */
+int execute_line(const char *line);
+int execute_text(const char *text, int more);
+
+#define EXEC_INCOMPLETE (-1)
+
+/*
+ * Scripts are read in large blocks and split into lines of any length.
+ * Lines are joined until they make complete commands, so quotes,
+ * $(...), trailing operators, backslash continuations, here-documents
+ * and for loops can span lines. Whether the text so far is complete is
+ * tracked incrementally by a ScriptScan, which looks at each new line
+ * once, so each command is lexed and parsed once, when it is complete.
+ */
+#define SCRIPT_CHUNK (64 * 1024)
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t pos, len, cap;
+    int eof;
+} ScriptReader;
+
+/* Next line without its newline, valid until the next call; NULL at EOF */
+static const char *script_getline(ScriptReader *r, size_t *n) {
+    size_t scan = r->pos;
+    while (1) {
+        char *nl = r->len > scan ? memchr(r->buf + scan, '\n', r->len - scan) : NULL;
+        if (nl || (r->eof && r->len > r->pos)) {
+            char *line = r->buf + r->pos;
+            *n = (nl ? nl : r->buf + r->len) - line;
+            r->pos += *n + (nl != NULL);
+            return line;
+        }
+        if (r->eof) return NULL;
+        /* Keep the partial line and read another block behind it */
+        if (r->buf) {
+            memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+            r->len -= r->pos;
+            r->pos = 0;
+        }
+        scan = r->len;
+        if (r->cap - r->len < SCRIPT_CHUNK + 1) {
+            r->cap = r->cap ? r->cap * 2 : SCRIPT_CHUNK * 2;
+            r->buf = realloc(r->buf, r->cap);
+        }
+        ssize_t got = read(r->fd, r->buf + r->len, SCRIPT_CHUNK);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) r->eof = 1;
+        else r->len += got;
+    }
+}
+
+/*
+ * Line-at-a-time completeness check for run_script(). It follows the
+ * lexer's rules for quotes, $(...), ${...}, comments and here-documents,
+ * and counts `for`/`done` at command position; the parser still has the
+ * final say (run_script falls back to re-parsing if it disagrees).
+ */
+#define SCAN_DEPTH 256
+
+typedef struct {
+    size_t pos;                 /* text scanned so far */
+    char stack[SCAN_DEPTH];     /* open ' " $( ${ */
+    int depth;
+    int lost;                   /* nesting too deep to follow: let the parser decide */
+    int inword;
+    size_t wstart;
+    int cmdpos;                 /* next word is a command name */
+    int loops;                  /* open for loops */
+    int more;                   /* ends in | && || */
+    int cont;                   /* ends in backslash-newline */
+    int doc_word, doc_dash;     /* next word is a here-document delimiter */
+    char docs[MAX_HEREDOCS][128];
+    int dash[MAX_HEREDOCS];
+    int ndocs, doc, body;       /* pending here-documents; reading body `doc` */
+} ScriptScan;
+
+static void scan_reset(ScriptScan *s) {
+    memset(s, 0, sizeof(*s));
+    s->cmdpos = 1;
+}
+
+static void scan_push(ScriptScan *s, char c) {
+    if (s->depth == SCAN_DEPTH) s->lost = 1;
+    else s->stack[s->depth++] = c;
+}
+
+static void scan_word_end(ScriptScan *s, const char *w, size_t n) {
+    s->inword = 0;
+    if (s->doc_word) {
+        /* Quoting is dropped from the delimiter, as in heredoc_delim() */
+        s->doc_word = 0;
+        if (s->ndocs == MAX_HEREDOCS) return;
+        char *d = s->docs[s->ndocs];
+        size_t k = 0;
+        for (size_t i = 0; i < n && k < sizeof(s->docs[0]) - 1; i++) {
+            if (w[i] == '\'' || w[i] == '"') continue;
+            if (w[i] == '\\' && i + 1 < n) i++;
+            d[k++] = w[i];
+        }
+        d[k] = '\0';
+        s->dash[s->ndocs++] = s->doc_dash;
+        return;
+    }
+    if (!s->cmdpos) return;
+    s->cmdpos = 0;
+    if (n == 3 && memcmp(w, "for", 3) == 0) s->loops++;
+    else if (n == 4 && memcmp(w, "done", 4) == 0 && s->loops > 0) s->loops--;
+    else if (n == 2 && memcmp(w, "do", 2) == 0) s->cmdpos = 1;
+}
+
+/* Scan t[s->pos, len), which ends in a newline; returns 1 if t is complete */
+static int script_scan(ScriptScan *s, const char *t, size_t len) {
+    size_t i = s->pos;
+    while (i < len && !s->lost) {
+        s->cont = 0;
+        if (s->body) {
+            /* Here-document body: only the delimiter line matters */
+            const char *nl = memchr(t + i, '\n', len - i);
+            size_t end = nl ? (size_t)(nl - t) : len;
+            size_t b = i;
+            if (s->dash[s->doc]) while (b < end && t[b] == '\t') b++;
+            const char *d = s->docs[s->doc];
+            if (end - b == strlen(d) && memcmp(t + b, d, end - b) == 0 && ++s->doc == s->ndocs)
+                s->body = s->ndocs = s->doc = 0;
+            i = nl ? end + 1 : end;
+            continue;
+        }
+        char c = t[i];
+        char top = s->depth ? s->stack[s->depth - 1] : 0;
+        if (top == '\'' || top == '{') {
+            if (c == (top == '{' ? '}' : '\'')) s->depth--;
+            i++;
+            continue;
+        }
+        if (top == '"' || top == '(') {
+            if (c == '\\') i++;
+            else if (c == '"' && top == '"') s->depth--;
+            else if (c == '$' && t[i+1] == '(') scan_push(s, '('), i++;
+            else if (top == '(' && (c == '\'' || c == '"' || c == '(')) scan_push(s, c);
+            else if (top == '(' && c == ')') s->depth--;
+            i++;
+            continue;
+        }
+
+        if (c == '\\' && t[i+1] == '\n') {
+            s->cont = 1;
+            i += 2;
+            continue;
+        }
+        if (is_word_break(c)) {
+            if (s->inword) scan_word_end(s, t + s->wstart, i - s->wstart);
+            if (c == ' ' || c == '\t') {
+                i++;
+                continue;
+            }
+            if (c == '\n') {
+                if (s->ndocs) s->body = 1;
+                s->cmdpos = 1;
+                i++;
+                continue;
+            }
+            s->more = 0;
+            if (c == '|' || c == '&') {
+                int two = t[i+1] == c;
+                s->more = c == '|' || two;
+                s->cmdpos = 1;
+                i += two ? 2 : 1;
+            } else if (c == ';') {
+                s->cmdpos = 1;
+                i++;
+            } else if (c == '<' && t[i+1] == '<') {
+                s->doc_word = 1;
+                s->doc_dash = t[i+2] == '-';
+                i += s->doc_dash ? 3 : 2;
+            } else {
+                i += (t[i+1] == '>' || t[i+1] == '&') ? 2 : 1;
+            }
+            continue;
+        }
+        if (!s->inword) {
+            if (c == '#') {
+                while (i < len && t[i] != '\n') i++;
+                continue;
+            }
+            s->inword = 1;
+            s->wstart = i;
+            s->more = 0;
+        }
+        if (c == '\\') i++;
+        else if (c == '\'' || c == '"') scan_push(s, c);
+        else if (c == '$' && (t[i+1] == '(' || t[i+1] == '{')) scan_push(s, t[++i]);
+        i++;
+    }
+    s->pos = i;
+    return s->lost || (!s->depth && !s->loops && !s->more && !s->cont && !s->ndocs && !s->doc_word);
+}
+
+/* Run every command read from fd; returns the last status */
+static int run_script(int fd) {
+    ScriptReader r = { .fd = fd };
+    ScriptScan scan;
+    scan_reset(&scan);
+    char *text = NULL;
+    size_t tlen = 0, tcap = 0;
+    int ret = 0;
+    const char *line;
+    size_t n;
+    while (running && (line = script_getline(&r, &n))) {
+        if (tlen + n + 2 > tcap) {
+            tcap = (tlen + n + 2) * 2;
+            text = realloc(text, tcap);
+        }
+        memcpy(text + tlen, line, n);
+        tlen += n;
+        text[tlen++] = '\n';
+        text[tlen] = '\0';
+        if (!script_scan(&scan, text, tlen)) continue;
+        int st = execute_text(text, 1);
+        if (st == EXEC_INCOMPLETE) continue;
+        ret = st;
+        tlen = 0;
+        scan_reset(&scan);
+    }
+    /* Whatever is left ends mid-command */
+    if (running && tlen) ret = execute_text(text, 0);
+    free(text);
+    free(r.buf);
+    return ret;
+}
+
+int builtin_source(char **args, int argc) {
+    if (argc < 2) {
+        fprintf(stderr, "xsh: source: filename required\n");
+        return 1;
+    }
+    int fd = open(args[1], O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "xsh: source: %s: %s\n", args[1], strerror(errno));
+        return 1;
+    }
+    int ret = run_script(fd);
+    close(fd);
+    return ret;
+}
+
+/* ===== Builtin Registry ===== */
+/*
+ * Every builtin is described once here. Dispatch, `type`, `help` and
+ * completion all read this table; lookups go through a small hash index
+ * so deciding builtin-vs-external costs the same for either answer.
+ */
+#define BI_PIPELINE  0x01   /* may run as a pipeline stage */
+#define BI_PARENT    0x02   /* changes shell state; must run in the shell itself */
+#define BI_RCSAFE    0x04   /* effects are fully captured by an rc snapshot */
+
+typedef int (*BuiltinFn)(char **args, int argc);
+
+typedef struct {
+    const char *name;
+    BuiltinFn fn;
+    int flags;
+    const char *usage;      /* NULL hides the entry from help and completion */
+    const char *desc;
+} Builtin;
+
+int builtin_help(char **args, int argc);
+int builtin_type(char **args, int argc);
+int builtin_exit(char **args, int argc);
+int builtin_true(char **args, int argc);
+int builtin_false(char **args, int argc);
+int builtin_cat(char **args, int argc);
+int builtin_parallel(char **args, int argc);
+
+static const Builtin builtin_table[] = {
+    {"cd",      builtin_cd,      BI_PARENT,               "cd [dir]",        "Change directory (- for previous)"},
+    {"pwd",     builtin_pwd,     BI_PIPELINE,             "pwd",             "Print working directory"},
+    {"echo",    builtin_echo,    BI_PIPELINE,             "echo [args]",     "Print text (-n to suppress newline)"},
+    {"export",  builtin_export,  BI_PARENT | BI_RCSAFE,   "export [k=v]",    "Set/show environment variables"},
+    {"unset",   builtin_unset,   BI_PARENT | BI_RCSAFE,   "unset [var]",     "Unset a shell variable"},
+    {"history", builtin_history, BI_PIPELINE,             "history [n]",     "Show command history"},
+    {"jobs",    builtin_jobs,    BI_PIPELINE,             "jobs",            "List background jobs"},
+    {"fg",      builtin_fg,      BI_PARENT,               "fg [job]",        "Bring job to foreground"},
+    {"bg",      builtin_bg,      BI_PARENT,               "bg [job]",        "Resume job in background"},
+    {"source",  builtin_source,  BI_PARENT,               "source [file]",   "Execute commands from file"},
+    {".",       builtin_source,  BI_PARENT,               NULL,              NULL},
+    {"alias",   builtin_alias,   BI_PARENT | BI_PIPELINE | BI_RCSAFE, "alias [k=v]",     "Create or list aliases"},
+    {"unalias", builtin_unalias, BI_PARENT | BI_RCSAFE,   "unalias [name]",  "Remove an alias"},
+    {"which",   builtin_which,   BI_PIPELINE,             "which [cmd]",     "Show command path"},
+    {"hash",    builtin_hash,    BI_PARENT | BI_PIPELINE, "hash [-r] [cmd]", "Show, clear or prefill the command path cache"},
+    {"type",    builtin_type,    BI_PIPELINE,             "type [cmd]",      "Describe a command"},
+    {"true",    builtin_true,    BI_PIPELINE,             "true",            "Return exit code 0"},
+    {"false",   builtin_false,   BI_PIPELINE,             "false",           "Return exit code 1"},
+    {"exit",    builtin_exit,    BI_PARENT,               "exit [n]",        "Exit shell with code n"},
+    {"cat",     builtin_cat,     BI_PIPELINE,             "cat [file...]",   "Concatenate files to stdout"},
+    {"parallel", builtin_parallel, BI_PIPELINE,           "parallel [-j n] cmd [::: args]", "Run cmd for each argument, n at a time"},
+    {"help",    builtin_help,    BI_PIPELINE,             "help",            "Show this help"},
+};
+
+/* Does this call only set or remove aliases and variables? Listings print. */
+static int builtin_rc_safe(const Builtin *bi, char **args, int argc) {
+    if (!(bi->flags & BI_RCSAFE) || argc < 2) return 0;
+    if (bi->fn == builtin_alias)
+        for (int i = 1; i < argc; i++)
+            if (!strchr(args[i], '=')) return 0;
+    return 1;
+}
+
+#define BUILTIN_COUNT  ((int)(sizeof(builtin_table) / sizeof(builtin_table[0])))
+#define BUILTIN_SLOTS  64   /* power of two, comfortably above BUILTIN_COUNT */
+
+static signed char builtin_index[BUILTIN_SLOTS];
+static int builtin_index_ready = 0;
+
+static void builtin_index_build(void) {
+    memset(builtin_index, -1, sizeof(builtin_index));
+    for (int i = 0; i < BUILTIN_COUNT; i++) {
+        unsigned int h = str_hash(builtin_table[i].name) & (BUILTIN_SLOTS - 1);
+        while (builtin_index[h] >= 0) h = (h + 1) & (BUILTIN_SLOTS - 1);
+        builtin_index[h] = (signed char)i;
+    }
+    builtin_index_ready = 1;
+}
+
+const Builtin *builtin_find(const char *name) {
+    if (!builtin_index_ready) builtin_index_build();
+    unsigned int h = str_hash(name) & (BUILTIN_SLOTS - 1);
+    while (builtin_index[h] >= 0) {
+        const Builtin *b = &builtin_table[(int)builtin_index[h]];
+        if (strcmp(b->name, name) == 0) return b;
+        h = (h + 1) & (BUILTIN_SLOTS - 1);
+    }
+    return NULL;
+}
+
+/* Run a builtin; output it could not write (e.g. `>&-`) is an error, as in bash */
+static int builtin_call(const Builtin *bi, char **args, int argc) {
+    errno = 0;
+    int st = bi->fn(args, argc);
+    if (fflush(stdout) != 0 || ferror(stdout)) {
+        int err = errno ? errno : EIO;
+        clearerr(stdout);
+        fprintf(stderr, "xsh: %s: write error: %s\n", bi->name, strerror(err));
+        return 1;
+    }
+    return st;
+}
+
+/* help */
+int builtin_help(char **args, int argc) {
+    (void)args; (void)argc;
+    printf("\n");
+    printf(FGRGB(0,255,200) BOLD "  ╔══════════════════════════════════════════════╗\n" RESET);
+    printf(FGRGB(0,255,200) BOLD "  ║       XSH - Built-in Commands                ║\n" RESET);
+    printf(FGRGB(0,255,200) BOLD "  ╚══════════════════════════════════════════════╝\n" RESET);
+    printf("\n");
+
+    for (int i = 0; i < BUILTIN_COUNT; i++) {
+        if (!builtin_table[i].usage) continue;
+        printf("  " FGRGB(0,220,255) BOLD "%-18s" RESET "  " FGRGB(180,180,200) "%s\n" RESET,
+               builtin_table[i].usage, builtin_table[i].desc);
+    }
+
+    printf("\n");
+    printf("  " FGRGB(100,100,150) "Features: pipes (|), redirection (< > >>), background (&),\n" RESET);
+    printf("  " FGRGB(100,100,150) "          glob expansion, env variables ($VAR), ~expansion\n" RESET);
+    printf("\n");
+    return 0;
+}
+
+/* type */
+int builtin_type(char **args, int argc) {
+    int ret = 0;
+    for (int i = 1; i < argc; i++) {
+        const char *alias_val = alias_get(args[i]);
+        if (alias_val) {
+            printf("%s is an alias for '%s'\n", args[i], alias_val);
+        } else if (builtin_find(args[i])) {
+            printf("%s is a shell builtin\n", args[i]);
+        } else {
+            const char *full = resolve_command(args[i]);
+            if (full) {
+                printf("%s is %s\n", args[i], full);
+            } else {
+                fprintf(stderr, "xsh: type: %s: not found\n", args[i]);
+                ret = 1;
+            }
+        }
+    }
+    return ret;
+}
+
+/* exit */
+int builtin_exit(char **args, int argc) {
+    running = 0;
+    return (argc > 1) ? atoi(args[1]) : last_exit_code;
+}
+
+int builtin_true(char **args, int argc) {
+    (void)args; (void)argc;
+    return 0;
+}
+
+int builtin_false(char **args, int argc) {
+    (void)args; (void)argc;
+    return 1;
+}
+
+/* ===== Glob Expansion ===== */
+/*
+ * Pathname expansion is done in-tree. A pattern is split at '/' into
+ * components and compiled once (compiled patterns are cached by text):
+ * literal components are joined onto the path without reading any
+ * directory, `**` matches zero or more directories, and the rest become
+ * small op lists matched with single-star backtracking. Directories are
+ * read with getdents64 on Linux (readdir elsewhere); a pattern that has
+ * to read more than one directory is walked by a pool of threads
+ * (XSH_GLOB_THREADS, default one per CPU up to 8) sharing a stack of
+ * pending directories, so memory grows with the matches, not the tree.
+ * Each pattern's matches are sorted bytewise; a pattern with no match is
+ * kept as the literal word. Expansion runs in the shell, once, before
+ * any stage of a pipeline is started.
+ */
+enum { G_CHAR, G_ANY, G_STAR, G_SET };
+
+typedef struct {
+    unsigned char op, ch;
+    unsigned char set[32];      /* G_SET: bitmap of accepted bytes */
+} GlobOp;
+
+enum { GC_LIT, GC_PAT, GC_STAR2 };
+
+typedef struct {
+    int kind;
+    char *lit;                  /* GC_LIT: unescaped name */
+    GlobOp *ops;                /* GC_PAT */
+    int nops;
+    int dot;                    /* GC_PAT: may match names starting with '.' */
+} GlobComp;
+
+typedef struct {
+    char *text;                 /* the pattern, as cached */
+    char *root;                 /* "/" for absolute patterns, else "" */
+    GlobComp *comps;
+    int ncomps;
+    int dir_only;               /* trailing '/' */
+    int parallel;               /* reads more than one directory */
+} GlobPat;
+
+#define GLOB_CACHE_SIZE 64
+static GlobPat *glob_cache[GLOB_CACHE_SIZE];
+
+/* Does the escaped field contain a live * ? or [ ? */
+static int glob_has_magic(const char *s) {
+    for (; *s; s++) {
+        if (*s == '\\' && s[1]) s++;
+        else if (*s == '*' || *s == '?' || *s == '[') return 1;
+    }
+    return 0;
+}
+
+/* Drop the escapes put_quoted() added */
+static char *glob_unescape(const char *s, size_t n) {
+    char *out = arena_alloc(&cmd_arena, n + 1);
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == '\\' && i + 1 < n) i++;
+        out[k++] = s[i];
+    }
+    out[k] = '\0';
+    return out;
+}
+
+static const struct {
+    const char *name;
+    int (*is)(int);
+} glob_classes[] = {
+    {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank},
+    {"cntrl", iscntrl}, {"digit", isdigit}, {"graph", isgraph},
+    {"lower", islower}, {"print", isprint}, {"punct", ispunct},
+    {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+};
+
+/* Length of a "[:name:]" at s[0, n), or 0 if there is none */
+static int glob_class_len(const char *s, int n) {
+    if (n < 4 || s[0] != '[' || s[1] != ':') return 0;
+    for (int i = 2; i + 1 < n; i++)
+        if (s[i] == ':' && s[i+1] == ']') return i + 2;
+    return 0;
+}
+
+/* Add the bytes of class "[:name:]" to a set; an unknown name adds none */
+static void glob_class_add(const char *s, int len, unsigned char *set) {
+    for (size_t i = 0; i < sizeof(glob_classes) / sizeof(glob_classes[0]); i++) {
+        if ((int)strlen(glob_classes[i].name) != len - 4 ||
+            strncmp(glob_classes[i].name, s + 2, len - 4) != 0) continue;
+        for (int c = 0; c < 256; c++)
+            if (glob_classes[i].is(c)) set[c >> 3] |= 1 << (c & 7);
+        return;
+    }
+}
+
+/* Compile one component s[0, n) into ops; returns the op count */
+static int glob_compile_ops(const char *s, int n, GlobOp *ops) {
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+        GlobOp *o = &ops[k];
+        memset(o, 0, sizeof(*o));
+        if (s[i] == '*') {
+            if (k > 0 && ops[k-1].op == G_STAR) continue;
+            o->op = G_STAR;
+        } else if (s[i] == '?') {
+            o->op = G_ANY;
+        } else if (s[i] == '[') {
+            /* Find the closing ']'; a ']' right after '[' or '[!' is literal */
+            int j = i + 1;
+            int neg = j < n && (s[j] == '!' || s[j] == '^');
+            if (neg) j++;
+            int first = j;
+            while (j < n && (s[j] != ']' || j == first)) {
+                int cl = glob_class_len(s + j, n - j);
+                j += cl ? cl : (s[j] == '\\' && j + 1 < n) ? 2 : 1;
+            }
+            if (j >= n) {
+                o->op = G_CHAR;
+                o->ch = '[';
+                k++;
+                continue;
+            }
+            o->op = G_SET;
+            for (int m = first; m < j; m++) {
+                int cl = glob_class_len(s + m, j - m);
+                if (cl) {
+                    glob_class_add(s + m, cl, o->set);
+                    m += cl - 1;
+                    continue;
+                }
+                unsigned char lo = s[m];
+                if (lo == '\\' && m + 1 < j) lo = s[++m];
+                unsigned char hi = lo;
+                if (m + 2 < j && s[m+1] == '-') {
+                    hi = s[m+2];
+                    m += 2;
+                    if (hi == '\\' && m + 1 < j) hi = s[++m];
+                }
+                for (int c = lo; c <= hi; c++) o->set[c >> 3] |= 1 << (c & 7);
+            }
+            if (neg) for (int b = 0; b < 32; b++) o->set[b] = ~o->set[b];
+            i = j;
+        } else {
+            if (s[i] == '\\' && i + 1 < n) i++;
+            o->op = G_CHAR;
+            o->ch = s[i];
+        }
+        k++;
+    }
+    return k;
+}
+
+static int glob_match(const GlobOp *ops, int nops, const char *s) {
+    int p = 0, star_p = -1;
+    const char *star_s = NULL;
+    while (*s) {
+        unsigned char c = *s;
+        if (p < nops && ops[p].op == G_STAR) {
+            star_p = ++p;
+            star_s = s;
+            continue;
+        }
+        if (p < nops && (ops[p].op == G_ANY ||
+                         (ops[p].op == G_CHAR && ops[p].ch == c) ||
+                         (ops[p].op == G_SET && (ops[p].set[c >> 3] & (1 << (c & 7)))))) {
+            p++;
+            s++;
+            continue;
+        }
+        if (star_p < 0) return 0;
+        p = star_p;
+        s = ++star_s;
+    }
+    while (p < nops && ops[p].op == G_STAR) p++;
+    return p == nops;
+}
+
+static void glob_pat_free(GlobPat *gp) {
+    for (int i = 0; i < gp->ncomps; i++) {
+        free(gp->comps[i].lit);
+        free(gp->comps[i].ops);
+    }
+    free(gp->comps);
+    free(gp->root);
+    free(gp->text);
+    free(gp);
+}
+
+static GlobPat *glob_compile(const char *pat) {
+    unsigned int h = str_hash(pat) % GLOB_CACHE_SIZE;
+    if (glob_cache[h] && strcmp(glob_cache[h]->text, pat) == 0) return glob_cache[h];
+
+    GlobPat *gp = calloc(1, sizeof(GlobPat));
+    gp->text = strdup(pat);
+    gp->root = strdup(pat[0] == '/' ? "/" : "");
+    size_t plen = strlen(pat);
+    gp->comps = calloc(plen / 2 + 2, sizeof(GlobComp));
+    const char *p = pat;
+    int dirs_read = 0;
+    while (*p) {
+        while (*p == '/') p++;
+        if (!*p) {
+            gp->dir_only = 1;
+            break;
+        }
+        const char *e = p;
+        while (*e && *e != '/') e += (*e == '\\' && e[1]) ? 2 : 1;
+        int n = e - p;
+        GlobComp *c = &gp->comps[gp->ncomps++];
+        char *seg = strndup(p, n);
+        if (n == 2 && p[0] == '*' && p[1] == '*') {
+            /* A second consecutive ** component adds nothing */
+            if (gp->ncomps > 1 && c[-1].kind == GC_STAR2) {
+                gp->ncomps--;
+                free(seg);
+                p = e;
+                continue;
+            }
+            c->kind = GC_STAR2;
+            dirs_read += 2;
+        } else if (glob_has_magic(seg)) {
+            c->kind = GC_PAT;
+            c->ops = malloc((n + 1) * sizeof(GlobOp));
+            c->nops = glob_compile_ops(p, n, c->ops);
+            c->dot = p[0] == '.' || (p[0] == '\\' && p[1] == '.');
+            dirs_read++;
+        } else {
+            c->kind = GC_LIT;
+            c->lit = strdup(glob_unescape(seg, n));
+        }
+        free(seg);
+        p = e;
+    }
+    if (plen > 0 && pat[plen-1] == '/') gp->dir_only = 1;
+    gp->parallel = dirs_read > 1;
+
+    if (glob_cache[h]) glob_pat_free(glob_cache[h]);
+    glob_cache[h] = gp;
+    return gp;
+}
+
+/* ---- Walking ---- */
+
+typedef struct GlobTask {
+    char *path;                 /* directory, "" for the current one */
+    int comp;                   /* component to match against its entries */
+    struct GlobTask *next;
+} GlobTask;
+
+typedef struct {
+    char **v;
+    size_t n, cap;
+} GlobResults;
+
+typedef struct {
+    const GlobPat *pat;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    GlobTask *stack;            /* pending directories, depth first */
+    int busy;                   /* workers holding a task */
+    int threaded;
+    GlobResults res;
+    int err;                    /* errno from the first directory, if it failed */
+} GlobWalk;
+
+#define GLOB_DENTS_BUF (64 * 1024)
+
+typedef struct {
+    int fd;
+#if defined(__linux__)
+    char *buf;
+    long len, off;
+#else
+    DIR *d;
+#endif
+} GlobDir;
+
+static int gdir_open(GlobDir *gd, const char *path, char *buf) {
+    gd->fd = openat(AT_FDCWD, *path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (gd->fd < 0) return -1;
+#if defined(__linux__)
+    gd->buf = buf;
+    gd->len = gd->off = 0;
+#else
+    (void)buf;
+    gd->d = fdopendir(gd->fd);
+    if (!gd->d) {
+        close(gd->fd);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/* Next entry name (never "." or ".."), with its d_type; NULL at the end */
+static const char *gdir_next(GlobDir *gd, unsigned char *type) {
+    while (1) {
+#if defined(__linux__)
+        if (gd->off >= gd->len) {
+            gd->len = syscall(SYS_getdents64, gd->fd, gd->buf, GLOB_DENTS_BUF);
+            gd->off = 0;
+            if (gd->len <= 0) return NULL;
+        }
+        struct {
+            unsigned long long d_ino;
+            long long d_off;
+            unsigned short d_reclen;
+            unsigned char d_type;
+            char d_name[];
+        } *de = (void *)(gd->buf + gd->off);
+        gd->off += de->d_reclen;
+        const char *name = de->d_name;
+        *type = de->d_type;
+#else
+        struct dirent *de = readdir(gd->d);
+        if (!de) return NULL;
+        const char *name = de->d_name;
+        *type = de->d_type;
+#endif
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+        return name;
+    }
+}
+
+static void gdir_close(GlobDir *gd) {
+#if defined(__linux__)
+    close(gd->fd);
+#else
+    closedir(gd->d);
+#endif
+}
+
+static char *glob_join(const char *dir, const char *name) {
+    size_t dl = strlen(dir), nl = strlen(name);
+    int sep = dl > 0 && dir[dl-1] != '/';
+    char *p = malloc(dl + sep + nl + 1);
+    memcpy(p, dir, dl);
+    if (sep) p[dl] = '/';
+    memcpy(p + dl + sep, name, nl + 1);
+    return p;
+}
+
+static void glob_emit(GlobWalk *w, GlobResults *r, char *path) {
+    if (w->pat->dir_only) {
+        char *d = glob_join(path, "");
+        free(path);
+        path = d;
+        size_t l = strlen(path);
+        if (l == 0 || path[l-1] != '/') {
+            path = realloc(path, l + 2);
+            strcpy(path + l, "/");
+        }
+    }
+    if (r->n == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 64;
+        r->v = realloc(r->v, r->cap * sizeof(char*));
+    }
+    r->v[r->n++] = path;
+}
+
+/* Is the entry a directory? `follow` resolves symlinks (not done for **) */
+static int glob_is_dir(int dirfd, const char *name, unsigned char type, int follow) {
+    if (type == DT_DIR) return 1;
+    if (type != DT_UNKNOWN && !(type == DT_LNK && follow)) return 0;
+    struct stat st;
+    return fstatat(dirfd, name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void glob_push(GlobWalk *w, char *path, int comp) {
+    GlobTask *t = malloc(sizeof(GlobTask));
+    t->path = path;
+    t->comp = comp;
+    if (w->threaded) pthread_mutex_lock(&w->lock);
+    t->next = w->stack;
+    w->stack = t;
+    if (w->threaded) {
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+/* Join literal components onto `path` (owned), then emit it or queue a directory read */
+static void glob_step(GlobWalk *w, GlobResults *r, char *path, int ci) {
+    const GlobPat *gp = w->pat;
+    while (ci < gp->ncomps && gp->comps[ci].kind == GC_LIT) {
+        char *next = glob_join(path, gp->comps[ci].lit);
+        free(path);
+        path = next;
+        ci++;
+    }
+    if (ci < gp->ncomps) {
+        glob_push(w, path, ci);
+        return;
+    }
+    struct stat st;
+    if (fstatat(AT_FDCWD, path, &st, gp->dir_only ? 0 : AT_SYMLINK_NOFOLLOW) == 0 &&
+        (!gp->dir_only || S_ISDIR(st.st_mode)))
+        glob_emit(w, r, path);
+    else
+        free(path);
+}
+
+/* A name matched component ci: emit it if that was the last one, else go deeper */
+static void glob_matched(GlobWalk *w, GlobResults *r, GlobDir *gd, const char *dir,
+                         const char *name, unsigned char type, int ci) {
+    const GlobPat *gp = w->pat;
+    if (ci + 1 == gp->ncomps) {
+        if (!gp->dir_only || glob_is_dir(gd->fd, name, type, 1)) glob_emit(w, r, glob_join(dir, name));
+    } else if (glob_is_dir(gd->fd, name, type, 1)) {
+        glob_step(w, r, glob_join(dir, name), ci + 1);
+    }
+}
+
+static void glob_read_dir(GlobWalk *w, GlobResults *r, GlobTask *t, char *buf) {
+    const GlobPat *gp = w->pat;
+    const GlobComp *c = &gp->comps[t->comp];
+    GlobDir gd;
+    if (gdir_open(&gd, t->path, buf) < 0) {
+        if (!strcmp(t->path, gp->root) && errno != ENOENT && errno != ENOTDIR) w->err = errno;
+        return;
+    }
+    /* After **, a literal next component is one lookup per directory */
+    int after = t->comp + 1;
+    if (c->kind == GC_STAR2 && after < gp->ncomps && gp->comps[after].kind == GC_LIT)
+        glob_step(w, r, strdup(t->path), after);
+
+    unsigned char type;
+    const char *name;
+    while ((name = gdir_next(&gd, &type))) {
+        if (c->kind == GC_PAT) {
+            if ((name[0] != '.' || c->dot) && glob_match(c->ops, c->nops, name))
+                glob_matched(w, r, &gd, t->path, name, type, t->comp);
+            continue;
+        }
+        /* ** : every entry is a candidate for the next component, and
+         * every (non-hidden, non-symlink) directory is descended into */
+        int hidden = name[0] == '.';
+        if (after == gp->ncomps) {
+            if (!hidden) glob_matched(w, r, &gd, t->path, name, type, t->comp);
+        } else if (gp->comps[after].kind == GC_PAT) {
+            const GlobComp *n = &gp->comps[after];
+            if ((!hidden || n->dot) && glob_match(n->ops, n->nops, name))
+                glob_matched(w, r, &gd, t->path, name, type, after);
+        }
+        if (!hidden && glob_is_dir(gd.fd, name, type, 0))
+            glob_push(w, glob_join(t->path, name), t->comp);
+    }
+    gdir_close(&gd);
+}
+
+static void *glob_worker(void *arg) {
+    GlobWalk *w = arg;
+    GlobResults mine = {0};
+    char *buf = malloc(GLOB_DENTS_BUF);
+    pthread_mutex_lock(&w->lock);
+    while (1) {
+        while (!w->stack && w->busy > 0) pthread_cond_wait(&w->cond, &w->lock);
+        if (!w->stack) break;
+        GlobTask *t = w->stack;
+        w->stack = t->next;
+        w->busy++;
+        pthread_mutex_unlock(&w->lock);
+
+        glob_read_dir(w, &mine, t, buf);
+        free(t->path);
+        free(t);
+
+        pthread_mutex_lock(&w->lock);
+        if (--w->busy == 0 && !w->stack) pthread_cond_broadcast(&w->cond);
+    }
+    /* Hand this thread's matches over */
+    for (size_t i = 0; i < mine.n; i++) {
+        if (w->res.n == w->res.cap) {
+            w->res.cap = w->res.cap ? w->res.cap * 2 : 64;
+            w->res.v = realloc(w->res.v, w->res.cap * sizeof(char*));
+        }
+        w->res.v[w->res.n++] = mine.v[i];
+    }
+    pthread_mutex_unlock(&w->lock);
+    free(mine.v);
+    free(buf);
+    return NULL;
+}
+
+static int glob_threads(void) {
+    const char *v = var_get("XSH_GLOB_THREADS");
+    long n = v && *v ? atol(v) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (v && *v) return n < 1 ? 1 : n > 64 ? 64 : (int)n;
+    return n < 1 ? 1 : n > 8 ? 8 : (int)n;
+}
+
+static int glob_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Match a compiled pattern; results are malloc'd, sorted and unique */
+static void glob_walk(const GlobPat *gp, GlobResults *out) {
+    GlobWalk w = { .pat = gp };
+    glob_step(&w, &w.res, strdup(gp->root), 0);
+
+    int nthreads = gp->parallel ? glob_threads() : 1;
+    if (nthreads > 1) {
+        pthread_t tids[64];
+        int started = 0;
+        w.threaded = 1;
+        pthread_mutex_init(&w.lock, NULL);
+        pthread_cond_init(&w.cond, NULL);
+        /* Helpers should not take the shell's signals */
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        for (int i = 1; i < nthreads; i++)
+            if (pthread_create(&tids[started], NULL, glob_worker, &w) == 0) started++;
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        glob_worker(&w);
+        for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+        pthread_mutex_destroy(&w.lock);
+        pthread_cond_destroy(&w.cond);
+    } else {
+        char *buf = malloc(GLOB_DENTS_BUF);
+        while (w.stack) {
+            GlobTask *t = w.stack;
+            w.stack = t->next;
+            glob_read_dir(&w, &w.res, t, buf);
+            free(t->path);
+            free(t);
+        }
+        free(buf);
+    }
+    if (w.err) fprintf(stderr, "xsh: %s: %s\n", gp->text, strerror(w.err));
+
+    if (w.res.n > 1) qsort(w.res.v, w.res.n, sizeof(char*), glob_cmp);
+    size_t k = 0;
+    for (size_t i = 0; i < w.res.n; i++) {
+        if (k > 0 && strcmp(w.res.v[k-1], w.res.v[i]) == 0) free(w.res.v[i]);
+        else w.res.v[k++] = w.res.v[i];
+    }
+    w.res.n = k;
+    *out = w.res;
+}
+
+/*
+ * Append fields to `out`, replacing each pattern by its matches. The argv
+ * index range filled by glob matches is reported in [*glob_first,
+ * *glob_end) (both -1 when nothing matched) for ARG_MAX batching.
+ */
+void expand_globs(char **tokens, int count, ArgVec *out, int *glob_first, int *glob_end) {
+    *glob_first = *glob_end = -1;
+
+    for (int i = 0; i < count; i++) {
+        const char *t = tokens[i];
+        if (!glob_has_magic(t)) {
+            av_push(out, strchr(t, '\\') ? glob_unescape(t, strlen(t)) : tokens[i]);
+            continue;
+        }
+        GlobResults r;
+        glob_walk(glob_compile(t), &r);
+        if (r.n == 0) {
+            av_push(out, glob_unescape(t, strlen(t)));
+        } else {
+            if (*glob_first < 0) *glob_first = out->n;
+            for (size_t j = 0; j < r.n; j++) {
+                av_push(out, arena_strdup(&cmd_arena, r.v[j]));
+                free(r.v[j]);
+            }
+            *glob_end = out->n;
+        }
+        free(r.v);
+    }
+}
+
+/* ===== Process Launch ===== */
+/*
+ * Children are started with posix_spawn(), which on glibc is a
+ * clone(CLONE_VM|CLONE_VFORK) and so never copies the shell's page tables.
+ * Redirections and pipe wiring are expressed as dup2 file actions; every
+ * fd the shell opens for a child is close-on-exec, so nothing else leaks.
+ * fork() remains as the fallback for what posix_spawn cannot express
+ * (ignoring SIGINT for background jobs, execvp's /bin/sh retry for
+ * scripts without a #! line, error reporting from the child).
+ *
+ * XSH_LAUNCH=fork forces the fork path, e.g. to benchmark the two.
+ */
+typedef struct {
+    int fd;     /* descriptor in the child */
+    int src;    /* descriptor in the parent that becomes `fd` */
+} FdMove;
+
+typedef struct {
+    FdMove *moves;      /* in cmd_arena, grown as needed */
+    int nmoves, capmoves;
+    int background;     /* child ignores SIGINT */
+    char **envp;        /* environment, or NULL for the exported variables */
+} LaunchSpec;
+
+#define MOVE_CLOSE (-2)     /* FdMove.src: close `fd` in the child (`n>&-`) */
+
+static void launch_move(LaunchSpec *ls, int fd, int src) {
+    if (src < 0 && src != MOVE_CLOSE) return;
+    if (ls->nmoves == ls->capmoves) {
+        int cap = ls->capmoves ? ls->capmoves * 2 : 8;
+        ls->moves = arena_realloc(&cmd_arena, ls->moves, ls->capmoves * sizeof(FdMove),
+                                  cap * sizeof(FdMove));
+        ls->capmoves = cap;
+    }
+    ls->moves[ls->nmoves].fd = fd;
+    ls->moves[ls->nmoves].src = src;
+    ls->nmoves++;
+}
+
+/* pipe() whose ends are not inherited across exec */
+static int make_pipe(int fds[2]) {
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) < 0) return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+/* Open a redirection target for a child; reports errors like the shell does */
+static int open_redirect(const char *file, int flags) {
+    int fd = open(file, flags | O_CLOEXEC, 0644);
+    if (fd < 0) fprintf(stderr, "xsh: %s: %s\n", file, strerror(errno));
+    return fd;
+}
+
+static int launch_use_spawn(void) {
+    const char *mode = var_get("XSH_LAUNCH");
+    return !(mode && strcmp(mode, "fork") == 0);
+}
+
+static pid_t launch_spawn(const char *path, char **argv, char **envp, const LaunchSpec *ls) {
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    pid_t pid = -1;
+
+    posix_spawn_file_actions_init(&fa);
+    for (int i = 0; i < ls->nmoves; i++) {
+        if (ls->moves[i].src == MOVE_CLOSE)
+            posix_spawn_file_actions_addclose(&fa, ls->moves[i].fd);
+        else
+            posix_spawn_file_actions_adddup2(&fa, ls->moves[i].src, ls->moves[i].fd);
+    }
+
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGQUIT);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    int err = posix_spawn(&pid, path, &fa, &attr, argv, envp);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+/* In a freshly forked child: wire up fds and reset signals */
+static void launch_child_setup(const LaunchSpec *ls) {
+    for (int i = 0; i < ls->nmoves; i++) {
+        if (ls->moves[i].src == MOVE_CLOSE)
+            close(ls->moves[i].fd);
+        else if (ls->moves[i].src == ls->moves[i].fd)
+            fcntl(ls->moves[i].fd, F_SETFD, 0);
+        else
+            dup2(ls->moves[i].src, ls->moves[i].fd);
+    }
+    signal(SIGINT, ls->background ? SIG_IGN : SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+}
+
+static pid_t launch_fork(const char *path, char **argv, char **envp, const LaunchSpec *ls) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    launch_child_setup(ls);
+
+    environ = envp;
+    if (path) execv(path, argv);
+    execvp(argv[0], argv);
+    fprintf(stderr, FGRGB(255,80,80) "✗" RESET " xsh: %s: %s\n", argv[0], strerror(errno));
+    _exit(127);
+}
+
+static int wait_status(pid_t pid) {
+    int status;
+    if (wait_child(pid, &status, 0) < 0) return 1;
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return 1;
+}
+
+/*
+ * Start argv[0] (already resolved to `path`, or NULL if not found) with
+ * the given fd wiring. Returns the child pid, or -1 if no child could be
+ * created at all.
+ */
+pid_t launch_process(const char *path, char **argv, const LaunchSpec *ls) {
+    TRACE_BEGIN("launch", argv[0]);
+    char **envp = ls->envp ? ls->envp : var_envp();
+    pid_t pid = -1;
+    if (path && !ls->background && launch_use_spawn())
+        pid = launch_spawn(path, argv, envp, ls);
+    /* On spawn failure the fork path retries and reports the error */
+    if (pid <= 0) {
+        pid = launch_fork(path, argv, envp, ls);
+        if (pid < 0) perror("xsh: fork");
+    }
+    trace_child_start(pid, argv[0]);
+    TRACE_END("launch");
+    return pid;
+}
+
+/* ===== ARG_MAX Batching ===== */
+/*
+ * With XSH_ARGSPLIT=1, a simple command whose glob expansion would exceed
+ * the kernel's ARG_MAX is run several times, xargs-style. Arguments before
+ * the first glob match and after the last one are repeated in every batch,
+ * so `rm -f *.log` and `cp *.log dest/` both split correctly.
+ */
+static int argsplit_enabled(void) {
+    const char *v = var_get("XSH_ARGSPLIT");
+    return v && *v && strcmp(v, "0") != 0;
+}
+
+static size_t argv_bytes(char **v, int from, int to) {
+    size_t n = 0;
+    for (int i = from; i < to; i++) n += strlen(v[i]) + 1 + sizeof(char*);
+    return n;
+}
+
+/* Room left for argv once the environment is accounted for */
+static size_t argv_limit(void) {
+    long max = sysconf(_SC_ARG_MAX);
+    if (max <= 0) max = 128 * 1024;
+    size_t env = sizeof(char*);
+    char **envp = var_envp();
+    for (int i = 0; envp[i]; i++) env += strlen(envp[i]) + 1 + sizeof(char*);
+    size_t headroom = 4096 + env;   /* mirrors xargs' safety margin */
+    return (size_t)max > headroom ? (size_t)max - headroom : 0;
+}
+
+static int execute_batched(const char *path, ArgVec *av, int first, int end, const LaunchSpec *ls) {
+    size_t limit = argv_limit();
+    size_t fixed = argv_bytes(av->v, 0, first) + argv_bytes(av->v, end, av->n) + sizeof(char*);
+    char **batch = arena_alloc(&cmd_arena, (av->n + 1) * sizeof(char*));
+    int ret = 0;
+
+    memcpy(batch, av->v, first * sizeof(char*));
+    int i = first;
+    while (i < end) {
+        int bn = first;
+        size_t used = fixed;
+        /* Always take at least one argument so progress is guaranteed */
+        do {
+            used += strlen(av->v[i]) + 1 + sizeof(char*);
+            batch[bn++] = av->v[i++];
+        } while (i < end && used + strlen(av->v[i]) + 1 + sizeof(char*) <= limit);
+        for (int j = end; j < av->n; j++) batch[bn++] = av->v[j];
+        batch[bn] = NULL;
+
+        pid_t pid = launch_process(path, batch, ls);
+        int status = pid > 0 ? wait_status(pid) : 1;
+        if (status != 0) ret = status;
+        if (pid <= 0) break;
+    }
+    return ret;
+}
+
+/* ===== Fast Copy (cat) ===== */
+/*
+ * Builtin cat moves data kernel-side where it can: copy_file_range between
+ * regular files, splice when either end is a pipe, sendfile from a regular
+ * file to anything else. Each step falls back to the next when the kernel
+ * refuses the pair, ending in a plain read/write loop with a large buffer.
+ * Options other than `-` and `--` are handed to the external cat.
+ */
+#define CAT_CHUNK  (1 << 20)
+#define CAT_BUFSZ  (128 * 1024)
+
+static volatile sig_atomic_t cat_interrupted = 0;
+
+static void cat_sigint(int sig) {
+    (void)sig;
+    cat_interrupted = 1;
+}
+
+/* Errors meaning "this fd pair is not supported", not a real I/O failure */
+static int copy_unsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EXDEV || err == EBADF ||
+           err == EOPNOTSUPP || err == ESPIPE;
+}
+
+static int write_all(int fd, const char *buf, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, buf, n);
+        if (w < 0) {
+            if (errno == EINTR && !cat_interrupted) continue;
+            return -1;
+        }
+        buf += w;
+        n -= w;
+    }
+    return 0;
+}
+
+/* Copy in -> out until EOF. Returns 0, or -1 with errno set. */
+static int copy_fd(int in, int out) {
+    struct stat si, so;
+    if (fstat(in, &si) < 0 || fstat(out, &so) < 0) return -1;
+    if (S_ISREG(si.st_mode) && si.st_dev == so.st_dev && si.st_ino == so.st_ino) {
+        errno = EINVAL;     /* `cat f >> f` would never reach EOF */
+        return -2;
+    }
+    ssize_t n;
+#if defined(__linux__)
+    if (S_ISREG(si.st_mode) && S_ISREG(so.st_mode)) {
+        while ((n = copy_file_range(in, NULL, out, NULL, CAT_CHUNK, 0)) > 0)
+            if (cat_interrupted) return -1;
+        if (n == 0) return 0;
+        if (!copy_unsupported(errno)) return -1;
+    }
+    if (S_ISFIFO(si.st_mode) || S_ISFIFO(so.st_mode)) {
+        while ((n = splice(in, NULL, out, NULL, CAT_CHUNK, SPLICE_F_MOVE)) > 0)
+            if (cat_interrupted) return -1;
+        if (n == 0) return 0;
+        if (!copy_unsupported(errno)) return -1;
+    }
+    if (S_ISREG(si.st_mode)) {
+        while ((n = sendfile(out, in, NULL, CAT_CHUNK)) > 0)
+            if (cat_interrupted) return -1;
+        if (n == 0) return 0;
+        if (!copy_unsupported(errno)) return -1;
+    }
+#endif
+    static char *buf;
+    if (!buf && !(buf = malloc(CAT_BUFSZ))) return -1;
+    while ((n = read(in, buf, CAT_BUFSZ)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR && !cat_interrupted) continue;
+            return -1;
+        }
+        if (write_all(out, buf, n) < 0) return -1;
+    }
+    return 0;
+}
+
+int builtin_cat(char **args, int argc) {
+    int first = 1;
+    if (first < argc && strcmp(args[first], "--") == 0) first++;
+    else
+        for (int i = 1; i < argc; i++)
+            if (args[i][0] == '-' && args[i][1]) {
+                pid_t pid = launch_process(cmdhash_lookup("cat"), args, &(LaunchSpec){0});
+                return pid > 0 ? wait_status(pid) : 127;
+            }
+
+    /* Let Ctrl-C interrupt a blocked read instead of restarting it */
+    struct sigaction sa = {0}, old;
+    sa.sa_handler = cat_sigint;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old);
+    cat_interrupted = 0;
+    fflush(stdout);
+
+    int ret = 0;
+    for (int i = first; i == first || i < argc; i++) {
+        const char *name = i < argc ? args[i] : "-";
+        int fd = strcmp(name, "-") == 0 ? STDIN_FILENO : open(name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "xsh: cat: %s: %s\n", name, strerror(errno));
+            ret = 1;
+            continue;
+        }
+        int r = copy_fd(fd, STDOUT_FILENO);
+        if (r == -2) fprintf(stderr, "xsh: cat: %s: input file is output file\n", name);
+        else if (r < 0 && !cat_interrupted) fprintf(stderr, "xsh: cat: %s: %s\n", name, strerror(errno));
+        if (r < 0) ret = 1;
+        if (fd != STDIN_FILENO) close(fd);
+        if (cat_interrupted) {
+            ret = 130;
+            break;
+        }
+    }
+    sigaction(SIGINT, &old, NULL);
+    return ret;
+}
+
+/* ===== Redirections ===== */
+/*
+ * Opens a command's redirections in the parent and records them as
+ * launch moves, in source order. Opened fds are collected in `opened` so
+ * the caller can close them once the child is running. Returns -1 after
+ * reporting an error.
+ */
+typedef struct {
+    int *v;                 /* in cmd_arena */
+    int n, cap;
+} FdList;
+
+/*
+ * Record an fd a redirection opened. It is first moved to `floor` or
+ * above, past every fd the command redirects: otherwise it could be a
+ * target itself (`3>a 4>b` would open a as fd 3), and restoring the
+ * shell's fds after a builtin would put the file back instead of
+ * closing it.
+ */
+static int fdlist_push(FdList *l, int fd, int floor) {
+    if (fd < floor) {
+        int high = fcntl(fd, F_DUPFD_CLOEXEC, floor);
+        if (high >= 0) {
+            close(fd);
+            fd = high;
+        }
+    }
+    if (l->n == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 8;
+        l->v = arena_realloc(&cmd_arena, l->v, l->cap * sizeof(int), cap * sizeof(int));
+        l->cap = cap;
+    }
+    l->v[l->n++] = fd;
+    return fd;
+}
+
+static int capture_fd(void);
+
+/*
+ * An unquoted here-document body expands like the inside of "...",
+ * except that a double quote is an ordinary character.
+ */
+static char *heredoc_expand(const char *body) {
+    StrBuf w = {0};
+    sb_putc(&w, '"');
+    for (int i = 0; body[i]; i++) {
+        int e;
+        if (body[i] == '"') {
+            sb_puts(&w, "\\\"");
+        } else if (body[i] == '\\' && body[i+1] == '"') {
+            sb_puts(&w, "\\\\\\\"");
+            i++;
+        } else if (body[i] == '\\' && body[i+1]) {
+            sb_putn(&w, body + i, 2);
+            i++;
+        } else if (body[i] == '$' && body[i+1] == '(' && (e = scan_subst(body, i + 2)) > 0) {
+            sb_putn(&w, body + i, e - i);
+            i = e - 1;
+        } else {
+            sb_putc(&w, body[i]);
+        }
+    }
+    sb_putc(&w, '"');
+    return expand_token(w.s);
+}
+
+/* The here-document's text in an unlinked file, positioned at its start */
+static int heredoc_open(Redir *r) {
+    const char *text = r->literal ? r->target : heredoc_expand(r->target);
+    int fd = capture_fd();
+    if (fd < 0) {
+        perror("xsh: here-document");
+        return -1;
+    }
+    size_t len = strlen(text), off = 0;
+    while (off < len) {
+        ssize_t n = write(fd, text + off, len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("xsh: here-document");
+            close(fd);
+            return -1;
+        }
+        off += n;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+static int redirs_prepare(Redir *r, LaunchSpec *ls, FdList *opened) {
+    int floor = 10;
+    for (Redir *q = r; q; q = q->next)
+        if (q->fd >= floor) floor = q->fd + 1;
+    for (; r; r = r->next) {
+        if (r->type == REDIR_HEREDOC) {
+            int fd = heredoc_open(r);
+            if (fd < 0) return -1;
+            launch_move(ls, r->fd, fdlist_push(opened, fd, floor));
+            continue;
+        }
+        if (r->type == REDIR_DUP) {
+            char *t = expand_token(r->target);
+            size_t digits = strspn(t, "0123456789");
+            if (strcmp(t, "-") == 0) {
+                launch_move(ls, r->fd, MOVE_CLOSE);
+            } else if (digits > 0 && !t[digits]) {
+                int src = atoi(t), known = 0;
+                /* Open in the shell, unless an earlier redirection here set or closed it */
+                for (int i = 0; i < ls->nmoves; i++)
+                    if (ls->moves[i].fd == src) known = ls->moves[i].src == MOVE_CLOSE ? -1 : 1;
+                if (known < 0 || (!known && fcntl(src, F_GETFD) < 0)) {
+                    fprintf(stderr, "xsh: %s: bad file descriptor\n", t);
+                    return -1;
                 }
+                launch_move(ls, r->fd, src);
+            } else if (r->fd == 1 && r->implicit_fd) {
+                /* `>&file`: stdout and stderr both go to file */
+                int fd = open_redirect(t, O_WRONLY | O_CREAT | O_TRUNC);
+                if (fd < 0) return -1;
+                fd = fdlist_push(opened, fd, floor);
+                launch_move(ls, 1, fd);
+                launch_move(ls, 2, fd);
+            } else {
+                fprintf(stderr, "xsh: %s: ambiguous redirect\n", t);
+                return -1;
             }
-            ret = 0;
+            continue;
+        }
+        int flags = O_RDONLY;
+        if (r->type == REDIR_OUT) flags = O_WRONLY | O_CREAT | O_TRUNC;
+        else if (r->type == REDIR_APPEND) flags = O_WRONLY | O_CREAT | O_APPEND;
+        int fd = open_redirect(expand_token(r->target), flags);
+        if (fd < 0) return -1;
+        launch_move(ls, r->fd, fdlist_push(opened, fd, floor));
+    }
+    return 0;
+}
+
+static void close_fds(FdList *l) {
+    for (int i = 0; i < l->n; i++) close(l->v[i]);
+    l->n = 0;
+}
+
+/* Apply launch moves to the shell itself (for builtins); returns the saved originals */
+static int *moves_apply(const LaunchSpec *ls) {
+    int *saved = arena_alloc(&cmd_arena, (ls->nmoves + 1) * sizeof(int));
+    /* Copies go above every fd involved, so no later move overwrites one */
+    int floor = 10;
+    for (int i = 0; i < ls->nmoves; i++) {
+        if (ls->moves[i].fd >= floor) floor = ls->moves[i].fd + 1;
+        if (ls->moves[i].src >= floor) floor = ls->moves[i].src + 1;
+    }
+    fflush(stdout);
+    for (int i = 0; i < ls->nmoves; i++) {
+        saved[i] = fcntl(ls->moves[i].fd, F_DUPFD_CLOEXEC, floor);
+        if (ls->moves[i].src == MOVE_CLOSE) close(ls->moves[i].fd);
+        else dup2(ls->moves[i].src, ls->moves[i].fd);
+    }
+    return saved;
+}
+
+static void moves_restore(const LaunchSpec *ls, int *saved) {
+    fflush(stdout);
+    for (int i = ls->nmoves - 1; i >= 0; i--) {
+        if (saved[i] >= 0) {
+            dup2(saved[i], ls->moves[i].fd);
+            close(saved[i]);
         } else {
-            /* Restore stdio before external command */
-            if (saved_stdout >= 0) { dup2(saved_stdout, STDOUT_FILENO); close(saved_stdout); saved_stdout = -1; }
-            if (saved_stdin >= 0) { dup2(saved_stdin, STDIN_FILENO); close(saved_stdin); saved_stdin = -1; }
-
-            /* Background execution */
-            if (background) {
-                pid_t pid = fork();
-                if (pid == 0) {
-                    signal(SIGINT, SIG_IGN);
-                    /* Re-apply redirections in child */
-                    if (output_file) {
-                        int flags2 = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
-                        int fd = open(output_file, flags2, 0644);
-                        if (fd >= 0) { dup2(fd, STDOUT_FILENO); close(fd); }
-                    }
-                    if (input_file) {
-                        int fd = open(input_file, O_RDONLY);
-                        if (fd >= 0) { dup2(fd, STDIN_FILENO); close(fd); }
-                    }
-                    int nc;
-                    char **exp = expand_globs(args, argc, &nc);
-                    execvp(exp[0], exp);
-                    exit(127);
-                } else if (pid > 0) {
-                    char cmd_str[256];
-                    strncpy(cmd_str, args[0], 255);
-                    Job *j = job_add(pid, cmd_str);
-                    if (j) printf("[%d] %d\n", j->job_id, pid);
-                    return 0;
+            close(ls->moves[i].fd);
+        }
+    }
+}
+
+/* ===== Command Execution ===== */
+
+/* NAME=value word? */
+static int is_assignment(const char *w) {
+    if (!isalpha((unsigned char)w[0]) && w[0] != '_') return 0;
+    const char *p = w;
+    while (isalnum((unsigned char)*p) || *p == '_') p++;
+    return *p == '=';
+}
+
+/*
+ * Prefix assignments (`A=1 B=2 cmd`) apply to that command only. An
+ * external command gets them in its envp, over the exported variables;
+ * a builtin sees them as shell variables for the duration of the call.
+ * Shell state is unchanged afterwards either way.
+ */
+static char **prefix_expand(Command *c, int n) {
+    char **as = arena_alloc(&cmd_arena, (n + 1) * sizeof(char*));
+    for (int i = 0; i < n; i++) as[i] = expand_token(c->words[i]);
+    return as;
+}
+
+static int same_name(const char *a, const char *b) {
+    while (*a == *b && *a != '=') a++, b++;
+    return *a == '=' && *b == '=';
+}
+
+static char **prefix_envp(char **as, int n) {
+    char **base = var_envp();
+    int nb = 0;
+    while (base[nb]) nb++;
+    char **env = arena_alloc(&cmd_arena, (nb + n + 1) * sizeof(char*));
+    int k = 0;
+    for (int i = 0; i < nb; i++) {
+        int j = 0;
+        while (j < n && !same_name(as[j], base[i])) j++;
+        if (j == n) env[k++] = base[i];
+    }
+    /* A later assignment to the same name wins */
+    for (int j = 0; j < n; j++) {
+        int m = j + 1;
+        while (m < n && !same_name(as[j], as[m])) m++;
+        if (m == n) env[k++] = as[j];
+    }
+    env[k] = NULL;
+    return env;
+}
+
+/* Returns the previous values (NULL where unset) for prefix_restore */
+static char **prefix_apply(char **as, int n) {
+    char **old = arena_alloc(&cmd_arena, (n + 1) * sizeof(char*));
+    for (int i = 0; i < n; i++) {
+        char *eq = strchr(as[i], '=');
+        *eq = '\0';
+        const char *v = var_get(as[i]);
+        old[i] = v ? arena_strdup(&cmd_arena, v) : NULL;
+        var_set(as[i], eq + 1, 0);
+        *eq = '=';
+    }
+    return old;
+}
+
+static void prefix_restore(char **as, char **old, int n) {
+    for (int i = n - 1; i >= 0; i--) {
+        char *eq = strchr(as[i], '=');
+        *eq = '\0';
+        if (old[i]) var_set(as[i], old[i], 0);
+        else var_unset(as[i]);
+        *eq = '=';
+    }
+}
+
+/* Expand the words of a command, skipping `skip` leading words */
+static void expand_words(Command *c, int skip, ArgVec *out, int *glob_first, int *glob_end) {
+    TRACE_BEGIN("expand", c->nwords > skip ? c->words[skip] : "");
+    ArgVec fields = {0};
+    for (int i = skip; i < c->nwords; i++) {
+        if (!strchr(c->words[i], '{')) {
+            expand_word(c->words[i], &fields);
+            continue;
+        }
+        BraceIter it;
+        brace_start(&it, c->words[i]);
+        for (const char *w; (w = brace_next(&it)); ) expand_word(w, &fields);
+        brace_free(&it);
+    }
+    TRACE_BEGIN("glob", NULL);
+    expand_globs(fields.v, fields.n, out, glob_first, glob_end);
+    TRACE_END("glob");
+    TRACE_END("expand");
+}
+
+int execute_list(CmdList *l);
+
+/*
+ * for NAME in WORDS: each word is brace-expanded one result at a time and
+ * its fields are assigned and run before the next is generated, with the
+ * arena reset in between, so the loop runs in constant memory however
+ * long the list is.
+ */
+static int execute_for(ForLoop *f) {
+    rc_cacheable = 0;
+    sigint_pending = 0;
+    int status = 0, stop = 0;
+    for (int i = 0; i < f->nwords && running && !stop; i++) {
+        BraceIter it;
+        brace_start(&it, f->words[i]);
+        const char *w;
+        while (running && !stop && (w = brace_next(&it))) {
+            ArenaMark mark = arena_mark(&cmd_arena);
+            ArgVec fields = {0}, vals = {0};
+            int glob_first, glob_end;
+            expand_word(w, &fields);
+            expand_globs(fields.v, fields.n, &vals, &glob_first, &glob_end);
+            for (int k = 0; k < vals.n && running && !stop; k++) {
+                var_set(f->name, vals.v[k], 0);
+                status = execute_list(f->body);
+                /* Ctrl-C in the body ends the loop, not just one pass */
+                if (sigint_pending || status == 128 + SIGINT) {
+                    status = 128 + SIGINT;
+                    stop = 1;
                 }
             }
-            return execute_external(args, argc, input_file, output_file, append);
+            arena_release(&cmd_arena, mark);
         }
+        brace_free(&it);
+    }
+    return status;
+}
 
-        /* Restore stdio for builtins */
-        fflush(stdout);
-        if (saved_stdout >= 0) { dup2(saved_stdout, STDOUT_FILENO); close(saved_stdout); }
-        if (saved_stdin >= 0) { dup2(saved_stdin, STDIN_FILENO); close(saved_stdin); }
+/* Run a simple command in the shell process (or launch it and wait) */
+static int execute_simple(Command *c, int background) {
+    if (c->redirs) rc_cacheable = 0;
+    if (c->loop) {
+        /* Redirections after `done` apply to the whole loop */
+        LaunchSpec ls = {0};
+        FdList opened = {0};
+        int ret = 1;
+        if (redirs_prepare(c->redirs, &ls, &opened) == 0) {
+            int *saved = moves_apply(&ls);
+            close_fds(&opened);
+            ret = execute_for(c->loop);
+            moves_restore(&ls, saved);
+        }
+        close_fds(&opened);
         return ret;
     }
+    if (c->nwords == 0) {
+        /* Redirections only: create/truncate the files, like `> file` */
+        LaunchSpec ls = {0};
+        FdList opened = {0};
+        int ret = redirs_prepare(c->redirs, &ls, &opened) < 0 ? 1 : 0;
+        close_fds(&opened);
+        return ret;
+    }
+
+    /* Assignments: KEY=value, possibly several */
+    int nassign = 0;
+    while (nassign < c->nwords && is_assignment(c->words[nassign])) nassign++;
+    if (nassign == c->nwords) {
+        for (int i = 0; i < nassign; i++) {
+            char *w = expand_token(c->words[i]);
+            char *eq = strchr(w, '=');
+            *eq = '\0';
+            var_set(w, eq + 1, 0);
+        }
+        return 0;
+    }
+
+    ArgVec av = {0};
+    int glob_first, glob_end;
+    expand_words(c, nassign, &av, &glob_first, &glob_end);
+    if (av.n == 0) return 0;
+    char **args = av.v;
+    int argc = av.n;
+    if (glob_first >= 0) rc_cacheable = 0;
+
+    LaunchSpec ls = { .background = background };
+    FdList opened = {0};
+    int ret = 1;
+    if (redirs_prepare(c->redirs, &ls, &opened) < 0) goto out;
+
+    char **assigns = prefix_expand(c, nassign);
+    const Builtin *bi = builtin_find(args[0]);
+    if (bi && !background) {
+        if (!builtin_rc_safe(bi, args, argc) || nassign) rc_cacheable = 0;
+        /* Builtins - apply redirections to the shell and restore afterwards */
+        int *saved = moves_apply(&ls);
+        close_fds(&opened);
+        char **old = prefix_apply(assigns, nassign);
+        TRACE_BEGIN("builtin", args[0]);
+        ret = builtin_call(bi, args, argc);
+        TRACE_END("builtin");
+        prefix_restore(assigns, old, nassign);
+        moves_restore(&ls, saved);
+        goto out;
+    }
+    if (nassign) ls.envp = prefix_envp(assigns, nassign);
+
+    rc_cacheable = 0;
+    const char *path = cmdhash_lookup(args[0]);
+    if (!background && glob_first >= 0 && argsplit_enabled() &&
+        argv_bytes(args, 0, argc) > argv_limit()) {
+        ret = execute_batched(path, &av, glob_first, glob_end, &ls);
+        goto out;
+    }
+
+    pid_t pid = launch_process(path, args, &ls);
+    if (pid > 0) {
+        if (background) {
+            Job *j = job_add(pid, args[0]);
+            if (j) printf("[%d] %d\n", j->job_id, pid);
+            ret = 0;
+        } else {
+            ret = wait_status(pid);
+        }
+    }
+
+out:
+    close_fds(&opened);
+    return ret;
+}
+
+/* ===== Pipe Sizing ===== */
+/*
+ * XSH_PIPE_SIZE=<bytes>[k|m] enlarges the pipes a pipeline creates with
+ * F_SETPIPE_SZ, so bulk stages wake each other up less often. A leading
+ * assignment on the first stage overrides it for that pipeline only:
+ *     XSH_PIPE_SIZE=4m zcat big.gz | grep x | sort
+ * The kernel may round the size up or cap it (fs.pipe-max-size); what was
+ * actually granted is left in XSH_PIPE_SIZE_GRANTED.
+ */
+static long parse_size(const char *s) {
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (end == s || n <= 0) return 0;
+    int shift = 0;
+    if (*end == 'k' || *end == 'K') shift = 10, end++;
+    else if (*end == 'm' || *end == 'M') shift = 20, end++;
+    /* F_SETPIPE_SZ takes an int */
+    if (*end || n > (INT_MAX >> shift)) return 0;
+    return n << shift;
+}
+
+static long pipe_size_wanted(Command *first) {
+    const char *v = var_get("XSH_PIPE_SIZE");
+    for (int i = 0; i < first->nwords && is_assignment(first->words[i]); i++)
+        if (strncmp(first->words[i], "XSH_PIPE_SIZE=", 14) == 0)
+            v = expand_token(first->words[i]) + 14;
+    if (!v || !*v) return 0;
+    long n = parse_size(v);
+    static char warned[32];
+    if (n == 0 && strncmp(v, warned, sizeof(warned) - 1) != 0) {
+        fprintf(stderr, "xsh: XSH_PIPE_SIZE: %s: not a size (bytes, or with k/m)\n", v);
+        snprintf(warned, sizeof(warned), "%s", v);
+    }
+    return n;
+}
+
+static void pipe_apply_size(int (*pipefds)[2], int npipes, long want) {
+#ifdef F_SETPIPE_SZ
+    static long warned = 0;
+    /* Unprivileged requests above pipe-max-size fail outright; back off
+     * on the first pipe and reuse whatever it got for the rest */
+    long got = -1;
+    for (long sz = want; sz >= 4096 && got < 0; sz /= 2)
+        got = fcntl(pipefds[0][1], F_SETPIPE_SZ, (int)sz);
+    if (got < 0) got = fcntl(pipefds[0][1], F_GETPIPE_SZ);
+    for (int i = 1; i < npipes; i++) fcntl(pipefds[i][1], F_SETPIPE_SZ, (int)got);
+
+    char num[32];
+    snprintf(num, sizeof(num), "%ld", got);
+    var_set("XSH_PIPE_SIZE_GRANTED", num, 0);
+    if (got < want && warned != want) {
+        fprintf(stderr, "xsh: pipe size %ld requested, %ld granted\n", want, got);
+        warned = want;
+    }
+#else
+    (void)pipefds; (void)npipes; (void)want;
+    var_set("XSH_PIPE_SIZE_GRANTED", "", 0);
+#endif
+}
 
-    /* Pipeline execution */
-    int num_cmds = pipe_count + 1;
-    int pipefds[MAX_ARGS][2];
-    pid_t pids[MAX_ARGS];
+/* ===== Execute Pipeline ===== */
+/* One pipeline stage, expanded and ready to launch */
+typedef struct {
+    LaunchSpec ls;
+    FdList opened;
+    ArgVec av;
+    char **assigns;
+    int nassign;
+    int glob_first, glob_end;
+    int skip;                   /* redirection failed or no words */
+} Stage;
 
+/*
+ * Fork a stage that runs inside a copy of the shell rather than exec'ing
+ * (builtins, ARG_MAX batches). In the child this returns 0 with the
+ * stage's fds in place and every other pipe end and redirection file
+ * closed.
+ */
+static pid_t fork_stage(const char *name, const LaunchSpec *ls, int (*pipefds)[2],
+                        int npipes, Stage *stages, int nstages) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) perror("xsh: fork");
+    if (pid != 0) {
+        trace_child_start(pid, name);
+        return pid;
+    }
+    launch_child_setup(ls);
+    for (int k = 0; k < npipes; k++) {
+        close(pipefds[k][0]);
+        close(pipefds[k][1]);
+    }
+    for (int k = 0; k < nstages; k++) close_fds(&stages[k].opened);
+    return 0;
+}
 
-    for (int i = 0; i < pipe_count; i++) {
-        if (pipe(pipefds[i]) < 0) {
+/*
+ * Builtins may appear anywhere in a pipeline. Middle stages run in a
+ * forked copy of the shell (no exec); a final-stage builtin that neither
+ * changes shell state nor needs to outlive the pipeline runs in the
+ * shell itself, so `history | grep x` and `ls | echo` cost one process
+ * less. Every stage is expanded before the first one is launched.
+ */
+int execute_pipeline(Pipeline *pl) {
+    if (pl->ncmds == 1) return execute_simple(&pl->cmds[0], 0);
+
+    TRACE_BEGIN("pipeline", pl->cmds[0].nwords ? pl->cmds[0].words[0] : "");
+    rc_cacheable = 0;
+    int num_cmds = pl->ncmds;
+    int npipes = num_cmds - 1;
+    int (*pipefds)[2] = arena_alloc(&cmd_arena, npipes * sizeof(*pipefds));
+    pid_t *pids = arena_alloc(&cmd_arena, num_cmds * sizeof(pid_t));
+    Stage *stages = arena_alloc(&cmd_arena, num_cmds * sizeof(Stage));
+    memset(stages, 0, num_cmds * sizeof(Stage));
+
+    for (int i = 0; i < npipes; i++) {
+        if (make_pipe(pipefds[i]) < 0) {
             perror("xsh: pipe");
+            for (int j = 0; j < i; j++) { close(pipefds[j][0]); close(pipefds[j][1]); }
+            TRACE_END("pipeline");
             return 1;
         }
     }
+    long pipe_size = pipe_size_wanted(&pl->cmds[0]);
+    if (pipe_size > 0) pipe_apply_size(pipefds, npipes, pipe_size);
+
+    for (int ci = 0; ci < num_cmds; ci++) {
+        Command *c = &pl->cmds[ci];
+        Stage *st = &stages[ci];
+        if (ci > 0) launch_move(&st->ls, STDIN_FILENO, pipefds[ci - 1][0]);
+        if (ci < npipes) launch_move(&st->ls, STDOUT_FILENO, pipefds[ci][1]);
+
+        while (st->nassign < c->nwords && is_assignment(c->words[st->nassign])) st->nassign++;
+
+        if (redirs_prepare(c->redirs, &st->ls, &st->opened) < 0) {
+            close_fds(&st->opened);
+            st->skip = 1;
+            continue;
+        }
+        if (c->loop) continue;
+        expand_words(c, st->nassign, &st->av, &st->glob_first, &st->glob_end);
+        if (st->av.n == 0) {
+            close_fds(&st->opened);
+            st->skip = 1;
+            continue;
+        }
+        st->assigns = st->nassign ? prefix_expand(c, st->nassign) : NULL;
+    }
+
+    /* Final-stage builtin deferred to run in the shell */
+    Stage *last = NULL;
+    const Builtin *last_bi = NULL;
+
+    for (int ci = 0; ci < num_cmds; ci++) {
+        Command *c = &pl->cmds[ci];
+        Stage *st = &stages[ci];
+        pids[ci] = -1;
+        if (st->skip) continue;
+
+        if (c->loop) {
+            /* A loop stage runs in a forked copy of the shell */
+            pids[ci] = fork_stage("for", &st->ls, pipefds, npipes, stages, num_cmds);
+            if (pids[ci] == 0) {
+                int status = execute_for(c->loop);
+                fflush(stdout);
+                _exit(status);
+            }
+            close_fds(&st->opened);
+            continue;
+        }
+
+        ArgVec *av = &st->av;
+        const Builtin *bi = builtin_find(av->v[0]);
+        if (bi && ci == num_cmds - 1 && (bi->flags & BI_PIPELINE) && !(bi->flags & BI_PARENT)) {
+            last_bi = bi;
+            last = st;
+            continue;
+        }
+        if (bi) {
+            pids[ci] = fork_stage(bi->name, &st->ls, pipefds, npipes, stages, num_cmds);
+            if (pids[ci] == 0) {
+                prefix_apply(st->assigns, st->nassign);
+                int status = builtin_call(bi, av->v, av->n);
+                _exit(status);
+            }
+        } else if (st->glob_first >= 0 && argsplit_enabled() &&
+                   argv_bytes(av->v, 0, av->n) > argv_limit()) {
+            /* Batches run one after another from a helper owning this stage's fds */
+            const char *path = cmdhash_lookup(av->v[0]);
+            pids[ci] = fork_stage(av->v[0], &st->ls, pipefds, npipes, stages, num_cmds);
+            if (pids[ci] == 0) {
+                LaunchSpec inherit = { .envp = st->nassign ? prefix_envp(st->assigns, st->nassign) : NULL };
+                _exit(execute_batched(path, av, st->glob_first, st->glob_end, &inherit));
+            }
+        } else {
+            if (st->nassign) st->ls.envp = prefix_envp(st->assigns, st->nassign);
+            pids[ci] = launch_process(cmdhash_lookup(av->v[0]), av->v, &st->ls);
+        }
+        close_fds(&st->opened);
+    }
+
+    int last_status = 1;
+    if (last_bi) {
+        /* Wire the last stage into the shell, then drop every pipe end so
+         * upstream writers see EOF/SIGPIPE as they would with a child */
+        int *saved = moves_apply(&last->ls);
+        for (int i = 0; i < npipes; i++) {
+            close(pipefds[i][0]);
+            close(pipefds[i][1]);
+        }
+        close_fds(&last->opened);
+        char **old = prefix_apply(last->assigns, last->nassign);
+        TRACE_BEGIN("builtin", last->av.v[0]);
+        last_status = builtin_call(last_bi, last->av.v, last->av.n);
+        TRACE_END("builtin");
+        prefix_restore(last->assigns, old, last->nassign);
+        moves_restore(&last->ls, saved);
+    } else {
+        /* Close all pipes in parent */
+        for (int i = 0; i < npipes; i++) {
+            close(pipefds[i][0]);
+            close(pipefds[i][1]);
+        }
+    }
+
+    /* Wait for all children */
+    for (int ci = 0; ci < num_cmds; ci++) {
+        int status = pids[ci] > 0 ? wait_status(pids[ci]) : 1;
+        if (ci == num_cmds - 1 && !last_bi) last_status = status;
+    }
+    TRACE_END("pipeline");
+    return last_status;
+}
+
+/* ===== And-Or Lists ===== */
+static int execute_and_or(AndOr *ao) {
+    int status = execute_pipeline(&ao->pipes[0]);
+    last_exit_code = status;
+    for (int i = 1; i < ao->npipes && running; i++) {
+        if ((ao->ops[i] == AO_AND && status != 0) || (ao->ops[i] == AO_OR && status == 0))
+            continue;
+        status = execute_pipeline(&ao->pipes[i]);
+        last_exit_code = status;
+    }
+    return status;
+}
+
+/* Run `cmd &`: single external commands go straight to the job table,
+ * anything else runs in a forked subshell */
+static int execute_async(AndOr *ao) {
+    rc_cacheable = 0;
+    if (ao->npipes == 1 && ao->pipes[0].ncmds == 1) {
+        Command *c = &ao->pipes[0].cmds[0];
+        if (c->nwords > 0 && !is_assignment(c->words[0]) && !builtin_find(c->words[0]))
+            return execute_simple(c, 1);
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("xsh: fork");
+        return 1;
+    }
+    if (pid == 0) {
+        signal(SIGINT, SIG_IGN);
+        int status = execute_and_or(ao);
+        fflush(stdout);
+        _exit(status);
+    }
+    const char *name = ao->pipes[0].cmds[0].nwords ? ao->pipes[0].cmds[0].words[0] : "subshell";
+    Job *j = job_add(pid, name);
+    if (j) printf("[%d] %d\n", j->job_id, pid);
+    return 0;
+}
+
+int execute_list(CmdList *l) {
+    int status = 0;
+    for (int i = 0; i < l->nitems && running; i++) {
+        if (l->items[i].background) status = execute_async(&l->items[i]);
+        else status = execute_and_or(&l->items[i]);
+    }
+    return status;
+}
+
+/* ===== Command Substitution ===== */
+/*
+ * $(...) runs through xsh's own parser and executor, so aliases,
+ * builtins and shell state behave as on the command line. A body that is
+ * a single builtin without parent side effects runs in-process with
+ * stdout pointed at an anonymous file; anything else runs in a forked
+ * child. Output is read in large chunks straight into the result buffer.
+ */
+#define SUBST_CHUNK (64 * 1024)
+
+/* Reads fd to EOF, appending to out */
+static void read_all(int fd, StrBuf *out) {
+    while (1) {
+        if (out->cap - out->len < SUBST_CHUNK + 1) {
+            size_t nc = out->cap ? out->cap * 2 : SUBST_CHUNK * 2;
+            out->s = arena_realloc(&cmd_arena, out->s, out->len, nc);
+            out->cap = nc;
+        }
+        ssize_t n = read(fd, out->s + out->len, out->cap - out->len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        out->len += n;
+    }
+    if (out->s) out->s[out->len] = '\0';
+}
+
+/* An in-process capture target for fd 1 */
+static int capture_fd(void) {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    int fd = memfd_create("xsh-subst", MFD_CLOEXEC);
+    if (fd >= 0) return fd;
+#endif
+    FILE *f = tmpfile();
+    if (!f) return -1;
+    int tfd = fcntl(fileno(f), F_DUPFD_CLOEXEC, 3);
+    fclose(f);
+    return tfd;
+}
+
+/* Can this body run inside the shell without changing its state? */
+static int subst_in_process(CmdList *l) {
+    if (l->nitems != 1 || l->items[0].background || l->items[0].npipes != 1) return 0;
+    Pipeline *pl = &l->items[0].pipes[0];
+    if (pl->ncmds != 1 || pl->cmds[0].nwords == 0) return 0;
+    const char *name = pl->cmds[0].words[0];
+    if (is_assignment(name)) return 0;
+    const Builtin *bi = builtin_find(name);
+    return bi && !(bi->flags & BI_PARENT);
+}
+
+static void subst_run(const char *cmd, StrBuf *out) {
+    int status;
+    CmdList *l = parse_line(cmd, &status);
+    if (!l) {
+        if (status == PARSE_INCOMPLETE)
+            fprintf(stderr, "xsh: syntax error: unexpected end of input\n");
+        return;
+    }
+
+    fflush(stdout);
+    if (subst_in_process(l)) {
+        int fd = capture_fd();
+        if (fd >= 0) {
+            int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+            dup2(fd, STDOUT_FILENO);
+            execute_list(l);
+            fflush(stdout);
+            if (saved >= 0) {
+                dup2(saved, STDOUT_FILENO);
+                close(saved);
+            }
+            lseek(fd, 0, SEEK_SET);
+            read_all(fd, out);
+            close(fd);
+            goto trim;
+        }
+    }
+
+    int pfd[2];
+    if (make_pipe(pfd) < 0) {
+        perror("xsh: pipe");
+        return;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("xsh: fork");
+        close(pfd[0]);
+        close(pfd[1]);
+        return;
+    }
+    if (pid == 0) {
+        close(pfd[0]);
+        dup2(pfd[1], STDOUT_FILENO);
+        close(pfd[1]);
+        signal(SIGINT, SIG_DFL);
+        int st = execute_list(l);
+        fflush(stdout);
+        _exit(st);
+    }
+    trace_child_start(pid, "$(...)");
+    close(pfd[1]);
+    read_all(pfd[0], out);
+    close(pfd[0]);
+    wait_status(pid);
+
+trim:
+    /* Strip trailing newlines */
+    while (out->len > 0 && out->s[out->len - 1] == '\n') out->len--;
+    if (out->s) out->s[out->len] = '\0';
+}
+
+static void command_subst(const char *cmd, StrBuf *out) {
+    rc_cacheable = 0;
+    TRACE_BEGIN("subst", cmd);
+    subst_run(cmd, out);
+    TRACE_END("subst");
+}
+
+/* ===== Parallel Jobs ===== */
+/*
+ * parallel [-j N] cmd [args...] [::: input...]
+ *
+ * Runs cmd once per input: the words after :::, or else one line of stdin
+ * each. `{}` in any word is replaced by the input; with no `{}` the input
+ * is appended. Up to N jobs run at once (default: the CPUs this process
+ * may run on) and a new one starts as soon as any finishes. Each job's
+ * stdout and stderr go to private capture files and are written out in
+ * one piece when it exits, so output never interleaves. Failed jobs are
+ * reported on stderr; the status is the number of failures, capped at 101.
+ */
+typedef struct {
+    pid_t pid;
+    int out, err;
+    int seq;
+    char *input;
+} ParJob;
+
+static int online_cpus(void) {
+#if defined(__linux__) && defined(CPU_COUNT)
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+        return CPU_COUNT(&set);
+#endif
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+/* Next input from the ::: list or stdin; caller frees */
+static char *par_next(char **list, int nlist, int *pos) {
+    if (list) return *pos < nlist ? strdup(list[(*pos)++]) : NULL;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n = getline(&line, &cap, stdin);
+    if (n < 0) {
+        free(line);
+        return NULL;
+    }
+    if (n > 0 && line[n - 1] == '\n') line[n - 1] = '\0';
+    return line;
+}
+
+static char *par_subst(const char *word, const char *input) {
+    size_t il = strlen(input), n = 1;
+    for (const char *p = word; *p; p++) n += (p[0] == '{' && p[1] == '}') ? il : 1;
+    char *r = malloc(n), *o = r;
+    while (*word) {
+        if (word[0] == '{' && word[1] == '}') {
+            memcpy(o, input, il);
+            o += il;
+            word += 2;
+        } else {
+            *o++ = *word++;
+        }
+    }
+    *o = '\0';
+    return r;
+}
 
-    int prev_end = 0;
-    for (int ci = 0; ci < num_cmds; ci++) {
-        int cmd_start = (ci == 0) ? 0 : pipe_positions[ci - 1];
-        int cmd_end   = (ci < pipe_count) ? pipe_positions[ci] : total_count;
-
-        char **cmd_args = all_tokens + cmd_start;
-        int cmd_argc = cmd_end - cmd_start;
-        char *saved_tok = cmd_args[cmd_argc]; /* save token before overwriting */
-        cmd_args[cmd_argc] = NULL;
-
-        pids[ci] = fork();
-        if (pids[ci] < 0) { perror("fork"); return 1; }
-        if (pids[ci] == 0) {
-            signal(SIGINT, SIG_DFL);
-
-            /* Input */
-            if (ci == 0 && input_file) {
-                int fd = open(input_file, O_RDONLY);
-                if (fd >= 0) { dup2(fd, STDIN_FILENO); close(fd); }
-            } else if (ci > 0) {
-                if (dup2(pipefds[ci - 1][0], STDIN_FILENO) < 0) { perror("dup2 stdin"); exit(1); }
-            }
-
-            /* Output */
-            if (ci == num_cmds - 1 && output_file) {
-                int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
-                int fd = open(output_file, flags, 0644);
-                if (fd >= 0) { dup2(fd, STDOUT_FILENO); close(fd); }
-            } else if (ci < num_cmds - 1) {
-                if (dup2(pipefds[ci][1], STDOUT_FILENO) < 0) { perror("dup2 stdout"); exit(1); }
-            }
+static pid_t par_start(char **tmpl, int ntmpl, ParJob *job, int devnull) {
+    int has_braces = 0;
+    for (int i = 0; i < ntmpl; i++) has_braces |= strstr(tmpl[i], "{}") != NULL;
+    char **argv = malloc((ntmpl + 2) * sizeof(char*));
+    int n = 0;
+    for (int i = 0; i < ntmpl; i++) argv[n++] = par_subst(tmpl[i], job->input);
+    if (!has_braces) argv[n++] = strdup(job->input);
+    argv[n] = NULL;
 
-            /* Close all pipe fds */
-            for (int j = 0; j < pipe_count; j++) {
-                close(pipefds[j][0]);
-                close(pipefds[j][1]);
-            }
+    LaunchSpec ls = {0};
+    if (devnull >= 0) launch_move(&ls, STDIN_FILENO, devnull);
+    launch_move(&ls, STDOUT_FILENO, job->out);
+    launch_move(&ls, STDERR_FILENO, job->err);
 
-            int new_count;
-            char **expanded = expand_globs(cmd_args, cmd_argc, &new_count);
-            execvp(expanded[0], expanded);
-            fprintf(stderr, "xsh: %s: %s\n", cmd_args[0], strerror(errno));
-            exit(127);
+    pid_t pid;
+    const Builtin *bi = builtin_find(argv[0]);
+    if (bi) {
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0) {
+            launch_child_setup(&ls);
+            _exit(builtin_call(bi, argv, n));
         }
-        /* Restore the token we overwrote with NULL */
-        cmd_args[cmd_argc] = saved_tok;
-        (void)prev_end;
-        prev_end = pipefds[ci < pipe_count ? ci : 0][0];
+        if (pid < 0) perror("xsh: fork");
+        trace_child_start(pid, bi->name);
+    } else {
+        pid = launch_process(cmdhash_lookup(argv[0]), argv, &ls);
     }
+    for (int i = 0; i < n; i++) free(argv[i]);
+    free(argv);
+    return pid;
+}
 
-    /* Close all pipes in parent */
-    for (int i = 0; i < pipe_count; i++) {
-        close(pipefds[i][0]);
-        close(pipefds[i][1]);
+/* Write a finished job's captured output, then its verdict */
+static void par_finish(ParJob *job, int status) {
+    fflush(stdout);
+    /* A job that never started may be missing either capture file */
+    if (job->out >= 0) {
+        lseek(job->out, 0, SEEK_SET);
+        copy_fd(job->out, STDOUT_FILENO);
+        close(job->out);
     }
-
-    /* Wait for all children */
-    int last_status = 0;
-    for (int ci = 0; ci < num_cmds; ci++) {
-        int status;
-        waitpid(pids[ci], &status, 0);
-        if (ci == num_cmds - 1) {
-            last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
-        }
+    if (job->err >= 0) {
+        lseek(job->err, 0, SEEK_SET);
+        copy_fd(job->err, STDERR_FILENO);
+        close(job->err);
     }
-    return last_status;
+    if (status != 0)
+        fprintf(stderr, "xsh: parallel: job %d (%s) exited with status %d\n",
+                job->seq, job->input, status);
+    free(job->input);
+    job->pid = 0;
 }
 
-/* ===== Main Execute Line ===== */
-int execute_line(const char *line) {
-    /* Skip empty or comments */
-    const char *p = line;
-    while (*p == ' ' || *p == '\t') p++;
-    if (*p == '\0' || *p == '#') return 0;
-
-    /* Handle semicolon-separated commands */
-    /* Simple check for ; outside quotes */
-    int in_s = 0, in_d = 0;
-    for (int i = 0; line[i]; i++) {
-        if (line[i] == '\'' && !in_d) { in_s = !in_s; continue; }
-        if (line[i] == '"' && !in_s) { in_d = !in_d; continue; }
-        if (line[i] == ';' && !in_s && !in_d) {
-            char part1[MAX_CMD_LEN], part2[MAX_CMD_LEN];
-            strncpy(part1, line, i);
-            part1[i] = '\0';
-            strncpy(part2, line + i + 1, sizeof(part2) - 1);
-            part2[sizeof(part2) - 1] = '\0';
-            execute_line(part1);
-            return execute_line(part2);
-        }
-    }
-
-    /* Handle && */
-    in_s = 0; in_d = 0;
-    for (int i = 0; line[i]; i++) {
-        if (line[i] == '\'' && !in_d) { in_s = !in_s; continue; }
-        if (line[i] == '"' && !in_s) { in_d = !in_d; continue; }
-        if (line[i] == '&' && line[i+1] == '&' && !in_s && !in_d) {
-            char part1[MAX_CMD_LEN], part2[MAX_CMD_LEN];
-            strncpy(part1, line, i);
-            part1[i] = '\0';
-            strncpy(part2, line + i + 2, sizeof(part2) - 1);
-            int r = execute_line(part1);
-            if (r == 0) return execute_line(part2);
-            return r;
+int builtin_parallel(char **args, int argc) {
+    int njobs = 0, first = 1;
+    if (first < argc && strncmp(args[first], "-j", 2) == 0) {
+        const char *v = args[first][2] ? args[first] + 2 : (first + 1 < argc ? args[++first] : "");
+        njobs = atoi(v);
+        if (njobs <= 0) {
+            fprintf(stderr, "xsh: parallel: -j needs a positive number\n");
+            return 2;
         }
+        first++;
+    }
+    int sep = first;
+    while (sep < argc && strcmp(args[sep], ":::") != 0) sep++;
+    if (sep == first) {
+        fprintf(stderr, "usage: parallel [-j n] cmd [args...] [::: input...]\n");
+        return 2;
     }
+    if (njobs == 0) njobs = online_cpus();
+
+    char **list = sep < argc ? args + sep + 1 : NULL;
+    int nlist = sep < argc ? argc - sep - 1 : 0, pos = 0;
+    int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    ParJob *slots = calloc(njobs, sizeof(ParJob));
+
+    /* Only the slot pids are waited for: `&` jobs and the stages feeding
+     * our stdin belong to others. SIGCHLD stays blocked outside
+     * sigsuspend() so an exit between the polls and the sleep is not lost */
+    sigset_t chld, oldmask, waitmask;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &oldmask);
+    waitmask = oldmask;
+    sigdelset(&waitmask, SIGCHLD);
+    struct sigaction sa = {0}, oldint;
+    sa.sa_handler = cat_sigint;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &oldint);
+    cat_interrupted = 0;
+    if (!list) clearerr(stdin);
+
+    int active = 0, seq = 0, failed = 0, eof = 0;
+    while (active > 0 || (!eof && !cat_interrupted)) {
+        while (active < njobs && !eof && !cat_interrupted) {
+            char *input = par_next(list, nlist, &pos);
+            if (!input) {
+                eof = 1;
+                break;
+            }
+            ParJob *job = slots;
+            while (job->pid) job++;
+            job->input = input;
+            job->seq = ++seq;
+            job->out = capture_fd();
+            job->err = capture_fd();
+            if (job->out < 0 || job->err < 0 ||
+                (job->pid = par_start(args + first, sep - first, job, devnull)) <= 0) {
+                par_finish(job, 127);
+                failed++;
+                continue;
+            }
+            active++;
+        }
+        if (active == 0) continue;
 
-    /* Handle || */
-    in_s = 0; in_d = 0;
-    for (int i = 0; line[i]; i++) {
-        if (line[i] == '\'' && !in_d) { in_s = !in_s; continue; }
-        if (line[i] == '"' && !in_s) { in_d = !in_d; continue; }
-        if (line[i] == '|' && line[i+1] == '|' && !in_s && !in_d) {
-            char part1[MAX_CMD_LEN], part2[MAX_CMD_LEN];
-            strncpy(part1, line, i);
-            part1[i] = '\0';
-            strncpy(part2, line + i + 2, sizeof(part2) - 1);
-            int r = execute_line(part1);
-            if (r != 0) return execute_line(part2);
-            return r;
+        int reaped = 0;
+        for (int i = 0; i < njobs; i++) {
+            int status;
+            if (!slots[i].pid) continue;
+            pid_t pid = wait_child(slots[i].pid, &status, WNOHANG);
+            if (pid == 0 || (pid < 0 && errno == EINTR)) continue;
+            int st = pid < 0 ? 1 : WIFEXITED(status) ? WEXITSTATUS(status) :
+                     WIFSIGNALED(status) ? 128 + WTERMSIG(status) : 1;
+            if (st != 0) failed++;
+            par_finish(&slots[i], st);
+            active--;
+            reaped = 1;
         }
+        if (!reaped) sigsuspend(&waitmask);
     }
 
-    ParseResult *pr = parse_line(line);
-    if (!pr || pr->count == 0) {
-        free_parse_result(pr);
-        free(pr);
-        return 0;
-    }
+    sigaction(SIGINT, &oldint, NULL);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    if (!list) clearerr(stdin);
+    free(slots);
+    if (devnull >= 0) close(devnull);
+    if (cat_interrupted) return 130;
+    return failed > 101 ? 101 : failed;
+}
 
-    /* DEBUG */
-    for (int di = 0; di < pr->count; di++) {
-    }
+/* ===== Main Execute Line ===== */
+/*
+ * Parse and run `text`, which may span several lines. With `more` set,
+ * text that stops in the middle of a command is not reported; the caller
+ * gets EXEC_INCOMPLETE and can append the next line and try again.
+ */
+int execute_text(const char *text, int more) {
+    static int depth = 0;
+    if (depth++ == 0) trace_sync();
+    TRACE_BEGIN("line", text);
 
-    int result = execute_pipeline(pr->tokens, pr->pipe_positions, pr->pipe_count, pr->count,
-                                   pr->input_file, pr->output_file, pr->append_output);
+    ArenaMark mark = arena_mark(&cmd_arena);
+    int status;
+    TRACE_BEGIN("parse", NULL);
+    CmdList *l = parse_line(text, &status);
+    TRACE_END("parse");
+    int result = 2;
+    if (l) {
+        result = execute_list(l);
+    } else if (status == PARSE_INCOMPLETE) {
+        if (more) result = EXEC_INCOMPLETE;
+        else fprintf(stderr, "xsh: syntax error: unexpected end of input\n");
+    }
+    arena_release(&cmd_arena, mark);
 
-    free_parse_result(pr);
-    free(pr);
+    TRACE_END("line");
+    /* Keep environ current for the C library between commands */
+    if (--depth == 0) var_envp();
     return result;
 }
 
+int execute_line(const char *line) {
+    return execute_text(line, 0);
+}
+
+/* Does `text` stop in the middle of a command? Syntax errors are left for execution */
+static int text_incomplete(const char *text) {
+    ArenaMark mark = arena_mark(&cmd_arena);
+    int status;
+    parse_quiet = 1;
+    parse_line(text, &status);
+    parse_quiet = 0;
+    arena_release(&cmd_arena, mark);
+    return status == PARSE_INCOMPLETE;
+}
+
 /* ===== Custom Readline Implementation ===== */
 
 static struct termios orig_termios;
-static char history_buf[MAX_HISTORY][MAX_CMD_LEN];
-static int history_count = 0;
+/*
+ * History store: entries are packed NUL-terminated into one growable
+ * arena and found through an offset index, so memory tracks what is
+ * actually stored. The oldest entries are dropped past XSH_HISTSIZE
+ * (default MAX_HISTORY); dead space at the front is compacted away once
+ * it outweighs the live part. The file is mmap'ed and split on newlines
+ * at startup, and saving appends only entries added since. Multi-line
+ * entries are stored as backslash-newline continued lines; backslashes
+ * ending a line are doubled, so an odd run can only be a continuation.
+ */
+static char *hist_arena;
+static size_t hist_used, hist_cap;
+static size_t *hist_off;            /* hist_off[hist_start + i] is entry i */
+static int hist_start, hist_end, hist_offcap;
+static int history_count = 0;       /* live entries */
+static long history_first = 0;      /* number of entries ever dropped */
+static long history_saved = 0;      /* entries (by absolute number) already in the file */
+static long history_file_lines = 0; /* entries the file holds */
+
+/* XSH_HISTSIZE may change at any time (rc file, prompt); re-parse it when it does */
+static int history_limit(void) {
+    static char seen[32];
+    static int limit = MAX_HISTORY;
+    const char *v = var_get("XSH_HISTSIZE");
+    if (!v) v = "";
+    if (strncmp(v, seen, sizeof(seen) - 1) != 0) {
+        snprintf(seen, sizeof(seen), "%s", v);
+        limit = atoi(v) > 0 ? atoi(v) : MAX_HISTORY;
+    }
+    return limit;
+}
+
+static const char *history_get(int i) {
+    return hist_arena + hist_off[hist_start + i];
+}
+
+/* Drop dead entries from the front of the arena and index */
+static void history_compact(void) {
+    size_t base = hist_off[hist_start];
+    memmove(hist_arena, hist_arena + base, hist_used - base);
+    hist_used -= base;
+    for (int i = 0; i < history_count; i++) hist_off[i] = hist_off[hist_start + i] - base;
+    hist_start = 0;
+    hist_end = history_count;
+}
+
+static void history_push(const char *line, size_t n) {
+    if (hist_used + n + 1 > hist_cap) {
+        while (hist_used + n + 1 > hist_cap) hist_cap = hist_cap ? hist_cap * 2 : 64 * 1024;
+        hist_arena = realloc(hist_arena, hist_cap);
+    }
+    if (hist_end == hist_offcap) {
+        hist_offcap = hist_offcap ? hist_offcap * 2 : 1024;
+        hist_off = realloc(hist_off, hist_offcap * sizeof(size_t));
+    }
+    hist_off[hist_end++] = hist_used;
+    memcpy(hist_arena + hist_used, line, n);
+    hist_arena[hist_used + n] = '\0';
+    hist_used += n + 1;
+    history_count++;
+
+    int limit = history_limit();
+    while (history_count > limit) {
+        hist_start++;
+        history_count--;
+        history_first++;
+    }
+    if (hist_start > history_count) history_compact();
+}
 
 void history_add(const char *line) {
     if (!line || !*line) return;
     /* Avoid duplicates */
-    if (history_count > 0 && strcmp(history_buf[(history_count - 1) % MAX_HISTORY], line) == 0)
+    if (history_count > 0 && strcmp(history_get(history_count - 1), line) == 0)
         return;
-    strncpy(history_buf[history_count % MAX_HISTORY], line, MAX_CMD_LEN - 1);
-    history_count++;
+    history_push(line, strlen(line));
 }
 
 void history_load(const char *path) {
-    FILE *f = fopen(path, "r");
-    if (!f) return;
-    char line[MAX_CMD_LEN];
-    while (fgets(line, sizeof(line), f)) {
-        line[strcspn(line, "\n")] = '\0';
-        if (*line) history_add(line);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return;
     }
-    fclose(f);
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    char *joined = NULL;            /* only used for continued entries */
+    size_t jlen = 0;
+    const char *p = map, *end = map + st.st_size;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t n = (nl ? nl : end) - p;
+        const char *next = nl ? nl + 1 : end;
+        size_t run = 0;
+        while (run < n && p[n - 1 - run] == '\\') run++;
+        int cont = run % 2 && next < end;
+        size_t keep = n - run + (cont ? run / 2 : (run + 1) / 2);
+        if (cont) {
+            joined = realloc(joined, jlen + keep + 1);
+            memcpy(joined + jlen, p, keep);
+            jlen += keep;
+            joined[jlen++] = '\n';
+        } else if (jlen > 0) {
+            joined = realloc(joined, jlen + keep);
+            memcpy(joined + jlen, p, keep);
+            history_push(joined, jlen + keep);
+            history_file_lines++;
+            jlen = 0;
+        } else if (n > 0) {
+            history_push(p, keep);
+            history_file_lines++;
+        }
+        p = next;
+    }
+    free(joined);
+    munmap(map, st.st_size);
+    history_saved = history_first + history_count;
+}
+
+static void history_write_entry(FILE *f, const char *e) {
+    while (1) {
+        size_t n = strcspn(e, "\n"), run = 0;
+        while (run < n && e[n - 1 - run] == '\\') run++;
+        fwrite(e, 1, n, f);
+        for (size_t i = 0; i < run; i++) fputc('\\', f);
+        if (!e[n]) break;
+        fputs("\\\n", f);
+        e += n + 1;
+    }
+    fputc('\n', f);
 }
 
+/*
+ * Append entries added this session. Once the file holds twice the limit
+ * it is rewritten with just the live entries.
+ */
 void history_save(const char *path) {
-    FILE *f = fopen(path, "w");
+    long total = history_first + history_count;
+    long fresh = total - history_saved;
+    if (fresh <= 0) return;
+    int rewrite = history_file_lines + fresh > 2L * history_limit();
+    int start = rewrite ? 0 : (int)(history_saved - history_first);
+    if (start < 0) start = 0;
+
+    char tmp[MAX_PATH + 16];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    FILE *f = fopen(rewrite ? tmp : path, rewrite ? "w" : "a");
     if (!f) return;
-    int start = (history_count > MAX_HISTORY) ? history_count - MAX_HISTORY : 0;
-    for (int i = start; i < history_count; i++) {
-        fprintf(f, "%s\n", history_buf[i % MAX_HISTORY]);
+    for (int i = start; i < history_count; i++) history_write_entry(f, history_get(i));
+    if (fclose(f) != 0 || (rewrite && rename(tmp, path) != 0)) {
+        if (rewrite) unlink(tmp);
+        return;
     }
-    fclose(f);
+    history_file_lines = rewrite ? history_count : history_file_lines + history_count - start;
+    history_saved = total;
+}
+
+/*
+ * Trigram index for Ctrl-R. Each bucket (trigrams hashed into
+ * TRIGRAM_BUCKETS) holds ascending absolute entry numbers. A query looks
+ * only at the candidates of its rarest trigram, newest first, and
+ * confirms each with strstr(); queries under three bytes scan backwards
+ * directly, since short needles match almost at once. The index is built
+ * on the first search, extended with new entries on later ones, and
+ * rebuilt once most of what it covers has been dropped from history.
+ */
+#define TRIGRAM_BUCKETS (1 << 16)
+
+typedef struct {
+    int *ids;
+    int n, cap;
+} Posting;
+
+static Posting *trigram_index;
+static long trigram_first;          /* history_first when the index was built */
+static long trigram_upto;           /* absolute entries indexed so far */
+
+static unsigned int trigram_hash(const char *t) {
+    unsigned int h = (unsigned char)t[0] | (unsigned char)t[1] << 8 | (unsigned)(unsigned char)t[2] << 16;
+    return (h * 2654435761u) >> 16;
 }
 
+static void trigram_reset(void) {
+    if (trigram_index) {
+        for (int b = 0; b < TRIGRAM_BUCKETS; b++) free(trigram_index[b].ids);
+        memset(trigram_index, 0, TRIGRAM_BUCKETS * sizeof(Posting));
+    } else {
+        trigram_index = calloc(TRIGRAM_BUCKETS, sizeof(Posting));
+    }
+    trigram_first = history_first;
+    trigram_upto = history_first;
+}
+
+static void trigram_sync(void) {
+    if (!trigram_index || history_first - trigram_first > history_count) trigram_reset();
+    if (trigram_upto < history_first) trigram_upto = history_first;
+    long total = history_first + history_count;
+    for (; trigram_upto < total; trigram_upto++) {
+        const char *e = history_get((int)(trigram_upto - history_first));
+        for (; e[0] && e[1] && e[2]; e++) {
+            Posting *pl = &trigram_index[trigram_hash(e)];
+            if (pl->n && pl->ids[pl->n - 1] == (int)trigram_upto) continue;
+            if (pl->n == pl->cap) {
+                pl->cap = pl->cap ? pl->cap * 2 : 4;
+                pl->ids = realloc(pl->ids, pl->cap * sizeof(int));
+            }
+            pl->ids[pl->n++] = (int)trigram_upto;
+        }
+    }
+}
+
+/* Newest live entry below `before` containing q, or -1 */
+static int history_search(const char *q, int before) {
+    size_t ql = strlen(q);
+    if (ql < 3) {
+        for (int i = before - 1; i >= 0; i--)
+            if (strstr(history_get(i), q)) return i;
+        return -1;
+    }
+    trigram_sync();
+    Posting *best = NULL;
+    for (size_t k = 0; k + 2 < ql; k++) {
+        Posting *pl = &trigram_index[trigram_hash(q + k)];
+        if (!best || pl->n < best->n) best = pl;
+    }
+    /* Candidates are ascending; start at the last one below `before` */
+    long limit = history_first + before;
+    int lo = 0, hi = best->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (best->ids[mid] < limit) lo = mid + 1;
+        else hi = mid;
+    }
+    for (int k = lo - 1; k >= 0 && best->ids[k] >= history_first; k--) {
+        int i = (int)(best->ids[k] - history_first);
+        if (strstr(history_get(i), q)) return i;
+    }
+    return -1;
+}
+
+/* Raw mode keeps type-ahead (TCSADRAIN) and turns on bracketed paste */
 static void enable_raw_mode(void) {
     tcgetattr(STDIN_FILENO, &orig_termios);
     struct termios raw = orig_termios;
@@ -1364,19 +5244,170 @@ static void enable_raw_mode(void) {
     raw.c_iflag &= ~(IXON | ICRNL);
     raw.c_cc[VMIN] = 1;
     raw.c_cc[VTIME] = 0;
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    if (write(STDOUT_FILENO, "\033[?2004h", 8) < 0) {}
 }
 
 static void disable_raw_mode(void) {
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+    fflush(stdout);
+    if (write(STDOUT_FILENO, "\033[?2004l", 8) < 0) {}
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &orig_termios);
 }
 
-/* Get terminal width */
+/*
+ * Keys are read in bulk into in_buf and decoded from there, so a burst
+ * of input costs one read() and the line is redrawn once the burst has
+ * been consumed. Bytes read past the end of a line wait here for the
+ * next prompt.
+ */
+static unsigned char in_buf[4096];
+static int in_pos, in_len;
+
+static int key_read(unsigned char *c) {
+    if (in_pos == in_len) {
+        ssize_t n;
+        do n = read(STDIN_FILENO, in_buf, sizeof(in_buf)); while (n < 0 && errno == EINTR);
+        if (n <= 0) return 0;
+        in_pos = 0;
+        in_len = n;
+    }
+    *c = in_buf[in_pos++];
+    return 1;
+}
+
+static int key_pending(void) {
+    return in_pos < in_len;
+}
+
+/* After ESC [ : collect parameter bytes and return the final byte (0 at EOF) */
+static unsigned char key_csi(char *params, int cap) {
+    int n = 0;
+    unsigned char c;
+    while (key_read(&c)) {
+        if (c >= 0x40 && c <= 0x7E) {
+            params[n] = '\0';
+            return c;
+        }
+        if (n < cap - 1) params[n++] = c;
+    }
+    params[n] = '\0';
+    return 0;
+}
+
+/* Get terminal width; cached until SIGWINCH */
 static int term_width(void) {
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
-        return ws.ws_col;
-    return 80;
+    static int width = 80;
+    if (winch_pending) {
+        winch_pending = 0;
+        struct winsize ws;
+        width = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    }
+    return width;
+}
+
+/*
+ * Line rendering. The editor remembers what it last put on screen after
+ * the prompt and where the cursor was; a refresh emits only the changed
+ * tail, an erase when the line got shorter, and cursor moves, all in one
+ * write(). render_reset() forces the prompt and line to be drawn afresh,
+ * for use after anything else has written to the terminal.
+ */
+static const char *rd_prompt = "";
+static char *rd_shown;
+static int rd_len, rd_cursor, rd_valid, rd_shown_cap;
+static char *rd_out;
+static size_t rd_outlen, rd_outcap;
+
+static void rd_put(const char *s, size_t n) {
+    if (rd_outlen + n > rd_outcap) {
+        while (rd_outlen + n > rd_outcap) rd_outcap = rd_outcap ? rd_outcap * 2 : 1024;
+        rd_out = realloc(rd_out, rd_outcap);
+    }
+    memcpy(rd_out + rd_outlen, s, n);
+    rd_outlen += n;
+}
+
+/* Terminal columns taken by n bytes of UTF-8 text (one per code point) */
+static int utf8_cols(const char *s, int n) {
+    int cols = 0;
+    for (int i = 0; i < n; i++) cols += ((unsigned char)s[i] & 0xC0) != 0x80;
+    return cols;
+}
+
+/* Move the cursor between byte offsets of the line being drawn */
+static void rd_move(const char *line, int from, int to) {
+    char seq[16];
+    int cols = from < to ? utf8_cols(line + from, to - from) : utf8_cols(line + to, from - to);
+    if (cols == 0) return;
+    rd_put(seq, snprintf(seq, sizeof(seq), "\033[%d%c", cols, from < to ? 'C' : 'D'));
+}
+
+static void render_reset(const char *prompt) {
+    rd_prompt = prompt;
+    rd_valid = 0;
+}
+
+static void render_refresh(const char *buf, int len, int cursor) {
+    if (cursor > len) cursor = len;
+    fflush(stdout);
+    rd_outlen = 0;
+
+    int from = 0;
+    if (!rd_valid) {
+        rd_put("\r\033[K", 4);
+        rd_put(rd_prompt, strlen(rd_prompt));
+        rd_len = rd_cursor = 0;
+    } else {
+        while (from < len && from < rd_len && buf[from] == rd_shown[from]) from++;
+        while (from > 0 && ((unsigned char)buf[from] & 0xC0) == 0x80) from--;
+    }
+
+    int old_tail = utf8_cols(rd_shown + from, rd_len - from);
+    int new_tail = utf8_cols(buf + from, len - from);
+    if (from == len && old_tail == 0) {
+        /* Text unchanged: only the cursor moves */
+        rd_move(buf, rd_cursor, cursor);
+    } else {
+        rd_move(rd_valid ? rd_shown : buf, rd_cursor, from);
+        /* Pasted newlines and tabs are drawn one column wide */
+        for (int i = from; i < len; ) {
+            int j = i;
+            while (j < len && buf[j] != '\n' && buf[j] != '\t') j++;
+            rd_put(buf + i, j - i);
+            if (j < len) rd_put(buf[j] == '\n' ? "\u23ce" : " ", buf[j] == '\n' ? 3 : 1);
+            i = j + 1;
+        }
+        if (old_tail > new_tail) rd_put("\033[K", 3);
+        rd_move(buf, len, cursor);
+    }
+
+    for (size_t off = 0; off < rd_outlen; ) {
+        ssize_t w = write(STDOUT_FILENO, rd_out + off, rd_outlen - off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) break;
+        off += w;
+    }
+    if (len > rd_shown_cap) {
+        rd_shown_cap = len * 2;
+        rd_shown = realloc(rd_shown, rd_shown_cap);
+    }
+    memcpy(rd_shown, buf, len);
+    rd_len = len;
+    rd_cursor = cursor;
+    rd_valid = 1;
+}
+
+#define COMPLETION_SHOW_MAX 1000   /* listing beyond this only reports a count */
+
+/* Set by get_completions when a directory listing is still being read */
+static int completion_partial = 0;
+
+static void comp_push(char ***results, int *cap, int *count, char *s) {
+    if (*count + 1 >= *cap) {
+        *cap *= 2;
+        *results = realloc(*results, *cap * sizeof(char*));
+    }
+    (*results)[(*count)++] = s;
 }
 
 /* Tab completion: return sorted list of matches */
@@ -1387,66 +5418,76 @@ static char **get_completions(const char *buf, int pos, int *count) {
     const char *word = buf + word_start;
     int word_len = pos - word_start;
 
-    char prefix[MAX_CMD_LEN];
-    strncpy(prefix, word, word_len);
-    prefix[word_len] = '\0';
+    char *prefix = strndup(word, word_len);
 
-    char **results = malloc(4096 * sizeof(char*));
+    int cap = 64;
+    char **results = malloc(cap * sizeof(char*));
     *count = 0;
+    completion_partial = 0;
 
     int is_first_word = (word_start == 0);
 
     if (!is_first_word || strchr(prefix, '/') || prefix[0] == '.' || prefix[0] == '~') {
-        /* File completion */
-        char pattern[MAX_PATH];
-        snprintf(pattern, sizeof(pattern), "%s*", prefix);
-        glob_t g;
-        if (glob(pattern, GLOB_TILDE | GLOB_MARK, NULL, &g) == 0) {
-            for (size_t i = 0; i < g.gl_pathc && *count < 4095; i++) {
-                results[(*count)++] = strdup(g.gl_pathv[i]);
+        /* File completion: names are matched against the word after the last '/' */
+        const char *slash = strrchr(prefix, '/');
+        const char *base = slash ? slash + 1 : prefix;
+        int dlen = slash ? (int)(slash - prefix) : 0;
+        char dir[MAX_PATH];
+        const char *home = var_get("HOME");
+        if (!slash)
+            strcpy(dir, ".");
+        else if (dlen == 0)
+            strcpy(dir, "/");
+        else if (prefix[0] == '~' && (dlen == 1 || prefix[1] == '/') && home)
+            snprintf(dir, sizeof(dir), "%s%.*s", home, dlen - 1, prefix + 1);
+        else
+            snprintf(dir, sizeof(dir), "%.*s", dlen, prefix);
+
+        DirCache *dc = dircache_get(dir, complete_budget_ms());
+        if (dc) {
+            size_t bl = strlen(base);
+            int keep = slash ? dlen + 1 : 0;
+            for (int i = 0; i < dc->n; i++) {
+                const char *nm = dc->names[i];
+                /* Like glob: dotfiles only when asked for */
+                if ((nm[0] == '.' && base[0] != '.') || strncmp(nm, base, bl) != 0) continue;
+                size_t nl = strlen(nm);
+                char *r = malloc(keep + nl + 1);
+                memcpy(r, prefix, keep);
+                memcpy(r + keep, nm, nl + 1);
+                comp_push(&results, &cap, count, r);
             }
-            globfree(&g);
+            completion_partial = !dc->complete;
         }
     } else {
         /* Command completion */
         /* Builtins */
-        const char *builtins[] = {"cd","pwd","echo","export","unset","history","help",
-            "alias","unalias","which","jobs","fg","bg","source","true","false","exit","type",NULL};
-        for (int i = 0; builtins[i] && *count < 4095; i++) {
-            if (strncmp(builtins[i], prefix, word_len) == 0)
-                results[(*count)++] = strdup(builtins[i]);
+        for (int i = 0; i < BUILTIN_COUNT; i++) {
+            if (builtin_table[i].usage && strncmp(builtin_table[i].name, prefix, word_len) == 0)
+                comp_push(&results, &cap, count, strdup(builtin_table[i].name));
         }
         /* Aliases */
-        for (int i = 0; i < alias_count && *count < 4095; i++) {
-            if (strncmp(aliases[i].name, prefix, word_len) == 0)
-                results[(*count)++] = strdup(aliases[i].name);
-        }
-        /* PATH */
-        char *path_env = getenv("PATH");
-        if (path_env) {
-            char path_copy[MAX_CMD_LEN];
-            strncpy(path_copy, path_env, sizeof(path_copy) - 1);
-            char *dir = strtok(path_copy, ":");
-            while (dir && *count < 4095) {
-                DIR *d = opendir(dir);
-                if (d) {
-                    struct dirent *ent;
-                    while ((ent = readdir(d)) && *count < 4095) {
-                        if (strncmp(ent->d_name, prefix, word_len) == 0) {
-                            char full[MAX_PATH];
-                            snprintf(full, sizeof(full), "%s/%s", dir, ent->d_name);
-                            if (access(full, X_OK) == 0) {
-                                results[(*count)++] = strdup(ent->d_name);
-                            }
-                        }
-                    }
-                    closedir(d);
-                }
-                dir = strtok(NULL, ":");
-            }
+        for (int i = 0; i < alias_count; i++) {
+            if (strncmp(aliases[i]->name, prefix, word_len) == 0)
+                comp_push(&results, &cap, count, strdup(aliases[i]->name));
         }
+        /* PATH, from the cached executable index */
+        int first;
+        int n = exec_index_match(prefix, word_len, &first);
+        for (int i = first; i < first + n; i++)
+            comp_push(&results, &cap, count, strdup(exec_names[i]));
+    }
+
+    /* Sorted, and a builtin shadowing /bin/echo is listed once */
+    qsort(results, *count, sizeof(char*), str_compare);
+    int u = 0;
+    for (int i = 0; i < *count; i++) {
+        if (u > 0 && strcmp(results[u - 1], results[i]) == 0) free(results[i]);
+        else results[u++] = results[i];
     }
+    *count = u;
     results[*count] = NULL;
+    free(prefix);
     return results;
 }
 
@@ -1466,42 +5507,129 @@ static char *common_prefix(char **completions, int count) {
     return cp;
 }
 
+/*
+ * The edit buffer is malloc'd and grows with the line; `cap` counts the
+ * byte for the terminating NUL.
+ */
+static char *line_reserve(char *buf, int *cap, int need) {
+    if (need + 1 > *cap) {
+        while (need + 1 > *cap) *cap *= 2;
+        buf = realloc(buf, *cap);
+    }
+    return buf;
+}
+
+static char *line_set(char *buf, int *cap, const char *s) {
+    int n = strlen(s);
+    buf = line_reserve(buf, cap, n);
+    memcpy(buf, s, n + 1);
+    return buf;
+}
+
+/*
+ * Ctrl-R: incremental search. Typing narrows the query, Ctrl-R again steps
+ * to older matches, Enter runs the match, Ctrl-G/Ctrl-C restore the line,
+ * and any other key keeps the match for editing. Returns 1 to submit.
+ */
+static int history_isearch(char **buf, int *cap, int *len, int *cursor) {
+    char query[256] = "";
+    int ql = 0;
+    int found = -1;
+    char *orig = strndup(*buf, *len);
+
+    char label[sizeof(query) + 32] = "";
+    while (1) {
+        const char *m = found >= 0 ? history_get(found) : "";
+        char next[sizeof(label)];
+        snprintf(next, sizeof(next), "%s'%s': ", found >= 0 || ql == 0 ? "(reverse-i-search)" :
+                 "(failed reverse-i-search)", query);
+        if (strcmp(next, label) != 0) {
+            strcpy(label, next);
+            render_reset(label);
+        }
+        int ml = strlen(m);
+        render_refresh(m, ml, ml);
+
+        unsigned char c;
+        if (!key_read(&c)) {
+            free(orig);
+            return 0;
+        }
+        if (c == 18) {
+            /* Older match for the same query */
+            int older = history_search(query, found >= 0 ? found : history_count);
+            if (older >= 0) found = older;
+            continue;
+        }
+        if (c == 127 || c == 8) {
+            if (ql > 0) query[--ql] = '\0';
+            found = ql ? history_search(query, history_count) : -1;
+            continue;
+        }
+        if (c >= 32 && c < 127) {
+            if (ql < (int)sizeof(query) - 1) {
+                query[ql++] = c;
+                query[ql] = '\0';
+                /* The current match may still fit; otherwise look further back */
+                if (found < 0 || !strstr(history_get(found), query))
+                    found = history_search(query, found >= 0 ? found : history_count);
+            }
+            continue;
+        }
+        if (c == 7 || c == 3) *buf = line_set(*buf, cap, orig);
+        else if (found >= 0) *buf = line_set(*buf, cap, history_get(found));
+        free(orig);
+        *len = *cursor = strlen(*buf);
+        return c == '\r' || c == '\n';
+    }
+}
+
+/* Set when the last xsh_readline() call ended with Ctrl-C */
+static int readline_cancelled;
+
 /* Our custom readline function */
 char *xsh_readline(const char *prompt) {
+    readline_cancelled = 0;
     if (!isatty(STDIN_FILENO)) {
-        /* Non-interactive: just read a line */
-        static char buf[MAX_CMD_LEN];
-        if (!fgets(buf, sizeof(buf), stdin)) return NULL;
-        buf[strcspn(buf, "\n")] = '\0';
-        return strdup(buf);
+        /* Non-interactive: just read a line, however long */
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t n = getline(&line, &cap, stdin);
+        if (n < 0) {
+            free(line);
+            return NULL;
+        }
+        line[strcspn(line, "\n")] = '\0';
+        return line;
     }
 
-    printf("%s", prompt);
-    fflush(stdout);
-
     enable_raw_mode();
 
-    char buf[MAX_CMD_LEN];
+    int cap = 256;
+    char *buf = malloc(cap);
     int len = 0;
     int cursor = 0;
     int hist_idx = history_count; /* start at "current" (empty) */
-    char saved[MAX_CMD_LEN] = "";
+    char *saved = NULL;
 
     buf[0] = '\0';
+    render_reset(prompt);
+    render_refresh(buf, 0, 0);
 
     while (1) {
         unsigned char c;
-        int n = read(STDIN_FILENO, &c, 1);
-        if (n <= 0) break;
+        if (!key_read(&c)) break;
 
         if (c == '\r' || c == '\n') {
             /* Enter */
+            render_refresh(buf, len, len);
             printf("\r\n");
             break;
 
         } else if (c == 3) {
             /* Ctrl-C */
             printf("^C\r\n");
+            readline_cancelled = 1;
             buf[0] = '\0';
             len = 0;
             break;
@@ -1510,6 +5638,8 @@ char *xsh_readline(const char *prompt) {
             /* Ctrl-D */
             if (len == 0) {
                 disable_raw_mode();
+                free(buf);
+                free(saved);
                 return NULL;
             }
 
@@ -1542,18 +5672,27 @@ char *xsh_readline(const char *prompt) {
             /* Ctrl-E: end */
             cursor = len;
 
+        } else if (c == 18) {
+            /* Ctrl-R: reverse incremental search */
+            int submit = history_isearch(&buf, &cap, &len, &cursor);
+            render_reset(prompt);
+            if (submit) {
+                render_refresh(buf, len, len);
+                printf("\r\n");
+                break;
+            }
+
         } else if (c == 12) {
             /* Ctrl-L: clear screen */
             printf("\033[2J\033[H");
-            printf("%s%.*s", prompt, len, buf);
-            fflush(stdout);
+            render_reset(prompt);
 
         } else if (c == '\t') {
             /* Tab completion */
             int comp_count;
             char **completions = get_completions(buf, cursor, &comp_count);
 
-            if (comp_count == 1) {
+            if (comp_count == 1 && !completion_partial) {
                 /* Find word start */
                 int ws = cursor;
                 while (ws > 0 && buf[ws-1] != ' ') ws--;
@@ -1561,14 +5700,15 @@ char *xsh_readline(const char *prompt) {
                 char *match = completions[0];
                 int match_len = strlen(match);
                 int add_len = match_len - word_len_cur;
-                if (add_len > 0 && len + add_len < MAX_CMD_LEN - 1) {
+                if (add_len > 0) {
+                    buf = line_reserve(buf, &cap, len + add_len + 1);
                     memmove(buf + cursor + add_len, buf + cursor, len - cursor);
                     memcpy(buf + cursor, match + word_len_cur, add_len);
                     len += add_len;
                     cursor += add_len;
                     buf[len] = '\0';
                     /* Add space if single match */
-                    if (buf[len-1] != '/' && len < MAX_CMD_LEN - 1) {
+                    if (buf[len-1] != '/') {
                         memmove(buf + cursor + 1, buf + cursor, len - cursor);
                         buf[cursor] = ' ';
                         len++;
@@ -1576,15 +5716,16 @@ char *xsh_readline(const char *prompt) {
                         buf[len] = '\0';
                     }
                 }
-            } else if (comp_count > 1) {
-                /* Show completions */
+            } else if (comp_count > 1 || completion_partial) {
+                /* Show completions; a partial listing can't prove a prefix is common */
                 char *cp = common_prefix(completions, comp_count);
                 int ws = cursor;
                 while (ws > 0 && buf[ws-1] != ' ') ws--;
                 int word_len_cur = cursor - ws;
                 int cp_len = strlen(cp);
-                if (cp_len > word_len_cur) {
+                if (!completion_partial && cp_len > word_len_cur) {
                     int add_len = cp_len - word_len_cur;
+                    buf = line_reserve(buf, &cap, len + add_len);
                     memmove(buf + cursor + add_len, buf + cursor, len - cursor);
                     memcpy(buf + cursor, cp + word_len_cur, add_len);
                     len += add_len;
@@ -1597,13 +5738,17 @@ char *xsh_readline(const char *prompt) {
                     int col_w = 20;
                     int cols = tw / col_w;
                     if (cols < 1) cols = 1;
-                    for (int i = 0; i < comp_count; i++) {
+                    int shown = comp_count < COMPLETION_SHOW_MAX ? comp_count : COMPLETION_SHOW_MAX;
+                    for (int i = 0; i < shown; i++) {
                         printf(FGRGB(0,220,255) "%-*s" RESET, col_w, completions[i]);
                         if ((i + 1) % cols == 0) printf("\r\n");
                     }
-                    if (comp_count % cols != 0) printf("\r\n");
-                    printf("%s%.*s", prompt, len, buf);
-                    fflush(stdout);
+                    if (shown % cols != 0) printf("\r\n");
+                    if (shown < comp_count)
+                        printf(FGRGB(150,150,150) "... %d more\r\n" RESET, comp_count - shown);
+                    if (completion_partial)
+                        printf(FGRGB(255,200,0) "… still reading directory, Tab again for more\r\n" RESET);
+                    render_reset(prompt);
                 }
                 free(cp);
             }
@@ -1611,91 +5756,101 @@ char *xsh_readline(const char *prompt) {
             free(completions);
 
         } else if (c == 27) {
-            /* Escape sequence */
-            unsigned char seq[4] = {0};
-            if (read(STDIN_FILENO, &seq[0], 1) <= 0) continue;
-            if (seq[0] == '[') {
-                if (read(STDIN_FILENO, &seq[1], 1) <= 0) continue;
-                if (seq[1] == 'A') {
-                    /* Up arrow: history prev */
-                    if (hist_idx > 0) {
-                        if (hist_idx == history_count) {
-                            strncpy(saved, buf, MAX_CMD_LEN - 1);
-                        }
-                        hist_idx--;
-                        int real_idx = hist_idx % MAX_HISTORY;
-                        strncpy(buf, history_buf[real_idx], MAX_CMD_LEN - 1);
-                        len = strlen(buf);
-                        cursor = len;
-                    }
-                } else if (seq[1] == 'B') {
-                    /* Down arrow: history next */
-                    if (hist_idx < history_count) {
-                        hist_idx++;
-                        if (hist_idx == history_count) {
-                            strncpy(buf, saved, MAX_CMD_LEN - 1);
-                        } else {
-                            strncpy(buf, history_buf[hist_idx % MAX_HISTORY], MAX_CMD_LEN - 1);
-                        }
-                        len = strlen(buf);
-                        cursor = len;
+            /* Escape sequence: CSI (ESC [ params final) or SS3 (ESC O final) */
+            unsigned char intro, fin = 0;
+            char params[16] = "";
+            if (!key_read(&intro)) continue;
+            if (intro == '[') fin = key_csi(params, sizeof(params));
+            else if (intro == 'O' && !key_read(&fin)) continue;
+            else if (intro != 'O') continue;
+
+            if (fin == 'A') {
+                /* Up arrow: history prev */
+                if (hist_idx > 0) {
+                    if (hist_idx == history_count) {
+                        free(saved);
+                        saved = strdup(buf);
                     }
-                } else if (seq[1] == 'C') {
-                    /* Right arrow */
-                    if (cursor < len) cursor++;
-                } else if (seq[1] == 'D') {
-                    /* Left arrow */
-                    if (cursor > 0) cursor--;
-                } else if (seq[1] == 'H') {
-                    cursor = 0;
-                } else if (seq[1] == 'F') {
+                    hist_idx--;
+                    buf = line_set(buf, &cap, history_get(hist_idx));
+                    len = strlen(buf);
                     cursor = len;
-                } else if (seq[1] == '3') {
-                    /* Delete key: ESC[3~ */
-                    unsigned char tmp;
-                    read(STDIN_FILENO, &tmp, 1);
-                    if (cursor < len) {
-                        memmove(buf + cursor, buf + cursor + 1, len - cursor);
-                        len--;
-                        buf[len] = '\0';
+                }
+            } else if (fin == 'B') {
+                /* Down arrow: history next */
+                if (hist_idx < history_count) {
+                    hist_idx++;
+                    if (hist_idx == history_count) {
+                        buf = line_set(buf, &cap, saved ? saved : "");
+                    } else {
+                        buf = line_set(buf, &cap, history_get(hist_idx));
                     }
-                } else if (seq[1] == '1' || seq[1] == '7') {
-                    unsigned char tmp;
-                    read(STDIN_FILENO, &tmp, 1);
-                    cursor = 0;
-                } else if (seq[1] == '4' || seq[1] == '8') {
-                    unsigned char tmp;
-                    read(STDIN_FILENO, &tmp, 1);
+                    len = strlen(buf);
                     cursor = len;
                 }
+            } else if (fin == 'C') {
+                /* Right arrow */
+                if (cursor < len) cursor++;
+            } else if (fin == 'D') {
+                /* Left arrow */
+                if (cursor > 0) cursor--;
+            } else if (fin == 'H') {
+                cursor = 0;
+            } else if (fin == 'F') {
+                cursor = len;
+            } else if (fin == '~' && strcmp(params, "3") == 0) {
+                /* Delete key: ESC[3~ */
+                if (cursor < len) {
+                    memmove(buf + cursor, buf + cursor + 1, len - cursor);
+                    len--;
+                    buf[len] = '\0';
+                }
+            } else if (fin == '~' && (strcmp(params, "1") == 0 || strcmp(params, "7") == 0)) {
+                cursor = 0;
+            } else if (fin == '~' && (strcmp(params, "4") == 0 || strcmp(params, "8") == 0)) {
+                cursor = len;
+            } else if (fin == '~' && strcmp(params, "200") == 0) {
+                /* Bracketed paste: insert everything up to ESC[201~ as text */
+                unsigned char pc;
+                int prev_cr = 0;
+                while (key_read(&pc)) {
+                    if (pc == 27) {
+                        unsigned char pi;
+                        char pp[16];
+                        if (key_read(&pi) && pi == '[' && key_csi(pp, sizeof(pp)) == '~' &&
+                            strcmp(pp, "201") == 0)
+                            break;
+                        continue;
+                    }
+                    /* \r and \r\n become one newline; other controls are dropped */
+                    int was_cr = prev_cr;
+                    prev_cr = pc == '\r';
+                    if (pc == '\n' && was_cr) continue;
+                    if (pc == '\r') pc = '\n';
+                    if (pc < 32 && pc != '\n' && pc != '\t') continue;
+                    buf = line_reserve(buf, &cap, len + 1);
+                    memmove(buf + cursor + 1, buf + cursor, len - cursor);
+                    buf[cursor++] = pc;
+                    buf[++len] = '\0';
+                }
             }
         } else if (c >= 32) {
             /* Regular character */
-            if (len < MAX_CMD_LEN - 1) {
-                memmove(buf + cursor + 1, buf + cursor, len - cursor);
-                buf[cursor] = c;
-                len++;
-                cursor++;
-                buf[len] = '\0';
-            }
+            buf = line_reserve(buf, &cap, len + 1);
+            memmove(buf + cursor + 1, buf + cursor, len - cursor);
+            buf[cursor] = c;
+            len++;
+            cursor++;
+            buf[len] = '\0';
         }
 
-        /* Redraw line */
-        printf("\r\033[K%s%s", prompt, buf);
-        /* Position cursor */
-        if (cursor < len) {
-            /* Move cursor left by (len - cursor) */
-            printf("\033[%dD", len - cursor);
-        }
-        fflush(stdout);
+        /* Redraw once the keys already read have been handled */
+        if (!key_pending()) render_refresh(buf, len, cursor);
     }
 
     disable_raw_mode();
-    if (buf[0] == '\0' && len == 0) {
-        /* Check if Ctrl-C */
-        return strdup("");
-    }
-    return strdup(buf);
+    free(saved);
+    return buf;
 }
 
 /* Wrapper for history display */
@@ -1705,7 +5860,7 @@ int builtin_history_display(char **args, int argc) {
     int start = 0;
     if (limit > 0 && limit < history_count) start = history_count - limit;
     for (int i = start; i < history_count; i++) {
-        printf(FGRGB(0,150,255) " %4d " RESET "%s\n", i + 1, history_buf[i % MAX_HISTORY]);
+        printf(FGRGB(0,150,255) " %4ld " RESET "%s\n", history_first + i + 1, history_get(i));
     }
     return 0;
 }
@@ -1714,23 +5869,241 @@ int builtin_history(char **args, int argc) {
     return builtin_history_display(args, argc);
 }
 
+/* ===== RC Snapshot Cache ===== */
+/*
+ * load_rc records what ~/.xshrc leaves behind -- variable changes and
+ * aliases -- in $XDG_CACHE_HOME/xsh (default ~/.cache/xsh). Later starts
+ * replay that snapshot from a single read instead of running the rc, as
+ * long as the key still matches: xsh version, rc path, inode, mtime and
+ * size, and a hash of the inherited environment. An rc that does
+ * anything else (external commands, $(...), pipelines, redirections,
+ * globs, other builtins, listings) runs normally every time and no
+ * snapshot is kept. XSH_RC_CACHE=0 turns the cache off.
+ *
+ * File layout: magic NUL key NUL, then records of a type byte followed
+ * by NUL-terminated name and value: 'e' exported variable, 'v' shell
+ * variable, 'u' unset, 'a' alias, 'r' unalias.
+ */
+#define RC_SNAP_MAGIC "xsh-rc-snapshot 2"
+
+typedef struct {
+    char **vars;            /* type byte ('e' or 'v') followed by NAME=value */
+    int nvars;
+    Alias *aliases;
+    int naliases;
+} RcState;
+
+static unsigned long long fnv64(unsigned long long h, const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int rc_snapshot_path(const char *rc_path, char *out, size_t n) {
+    char dir[MAX_PATH];
+    const char *base = var_get("XDG_CACHE_HOME");
+    if (base && *base) {
+        snprintf(dir, sizeof(dir), "%s", base);
+    } else {
+        const char *home = var_get("HOME");
+        if (!home) return -1;
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    }
+    mkdir(dir, 0700);
+    size_t dl = strlen(dir);
+    snprintf(dir + dl, sizeof(dir) - dl, "/xsh");
+    mkdir(dir, 0700);
+    unsigned long long h = fnv64(14695981039346656037ULL, rc_path, strlen(rc_path));
+    return snprintf(out, n, "%s/rc-%016llx", dir, h) < (int)n ? 0 : -1;
+}
+
+static void rc_snapshot_key(const char *rc_path, const struct stat *st, char *key, size_t n) {
+    unsigned long long h = 14695981039346656037ULL;
+    char **env = var_envp();
+    for (int i = 0; env[i]; i++) h = fnv64(h, env[i], strlen(env[i]) + 1);
+    long nsec = 0;
+#if defined(__linux__)
+    nsec = st->st_mtim.tv_nsec;
+#endif
+    snprintf(key, n, "%s %s %llu %lld.%09ld %lld %016llx", XSH_VERSION, rc_path,
+             (unsigned long long)st->st_ino, (long long)st->st_mtime, nsec,
+             (long long)st->st_size, h);
+}
+
+/* Walk the records; apply them only when `apply` is set. 0 if malformed. */
+static int rc_snapshot_replay(const char *p, const char *end, int apply) {
+    while (p < end) {
+        char type = *p++;
+        const char *name = p;
+        const char *z = memchr(p, '\0', end - p);
+        if (!z) return 0;
+        const char *value = z + 1;
+        z = value < end ? memchr(value, '\0', end - value) : NULL;
+        if (!z) return 0;
+        p = z + 1;
+        if (!apply) {
+            if (!strchr("evuar", type)) return 0;
+            continue;
+        }
+        if (type == 'e') {
+            var_set(name, value, VAR_EXPORT);
+        } else if (type == 'v') {
+            /* Not exported at the end of the rc, whatever it was before */
+            var_unset(name);
+            var_set(name, value, 0);
+        } else if (type == 'u') {
+            var_unset(name);
+        }
+        else if (type == 'a') alias_set(name, value);
+        else if (type == 'r') alias_remove(name);
+    }
+    return 1;
+}
+
+static int rc_snapshot_load(const char *snap, const char *key) {
+    int fd = open(snap, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    char *buf = NULL;
+    ssize_t got = -1;
+    if (fstat(fd, &st) == 0 && (buf = malloc(st.st_size + 1)))
+        got = read(fd, buf, st.st_size);
+    close(fd);
+
+    size_t ml = sizeof(RC_SNAP_MAGIC), kl = strlen(key) + 1;
+    int ok = got == st.st_size && (size_t)got >= ml + kl &&
+             memcmp(buf, RC_SNAP_MAGIC, ml) == 0 && memcmp(buf + ml, key, kl) == 0 &&
+             rc_snapshot_replay(buf + ml + kl, buf + got, 0);
+    if (ok) rc_snapshot_replay(buf + ml + kl, buf + got, 1);
+    free(buf);
+    return ok;
+}
+
+/* Every set variable as its type byte followed by NAME=value */
+static char **rc_vars(int *count) {
+    int n = 0, cap = 64;
+    char **out = malloc(cap * sizeof(char*));
+    for (int b = 0; b < VAR_BUCKETS; b++) {
+        for (Var *v = var_table[b]; v; v = v->next) {
+            if (!v->str) continue;
+            if (n == cap) out = realloc(out, (cap *= 2) * sizeof(char*));
+            size_t l = strlen(v->str);
+            out[n] = malloc(l + 2);
+            out[n][0] = (v->flags & VAR_EXPORT) ? 'e' : 'v';
+            memcpy(out[n] + 1, v->str, l + 1);
+            n++;
+        }
+    }
+    *count = n;
+    return out;
+}
+
+static void rc_vars_free(char **vars, int n) {
+    for (int i = 0; i < n; i++) free(vars[i]);
+    free(vars);
+}
+
+static void rc_state_capture(RcState *rs) {
+    rs->vars = rc_vars(&rs->nvars);
+    rs->naliases = alias_count;
+    rs->aliases = malloc((alias_count + 1) * sizeof(Alias));
+    for (int i = 0; i < alias_count; i++) {
+        rs->aliases[i].name = strdup(aliases[i]->name);
+        rs->aliases[i].value = strdup(aliases[i]->value);
+    }
+}
+
+static void rc_state_free(RcState *rs) {
+    rc_vars_free(rs->vars, rs->nvars);
+    for (int i = 0; i < rs->naliases; i++) {
+        free(rs->aliases[i].name);
+        free(rs->aliases[i].value);
+    }
+    free(rs->aliases);
+}
+
+static void rc_put(FILE *f, char type, const char *name, size_t nl, const char *value) {
+    fputc(type, f);
+    fwrite(name, 1, nl, f);
+    fputc('\0', f);
+    fwrite(value, 1, strlen(value) + 1, f);
+}
+
+/* Write the difference between `before` and now; atomic via rename */
+static void rc_snapshot_save(const char *snap, const char *key, const RcState *before) {
+    char tmp[MAX_PATH + 16];
+    snprintf(tmp, sizeof(tmp), "%s.%d", snap, (int)getpid());
+    FILE *f = fopen(tmp, "w");
+    if (!f) return;
+    fwrite(RC_SNAP_MAGIC, 1, sizeof(RC_SNAP_MAGIC), f);
+    fwrite(key, 1, strlen(key) + 1, f);
+
+    int nvars;
+    char **vars = rc_vars(&nvars);
+    for (int i = 0; i < nvars; i++) {
+        int j = 0;
+        while (j < before->nvars && strcmp(before->vars[j], vars[i]) != 0) j++;
+        const char *eq = strchr(vars[i], '=');
+        if (j == before->nvars) rc_put(f, vars[i][0], vars[i] + 1, eq - vars[i] - 1, eq + 1);
+    }
+    rc_vars_free(vars, nvars);
+    for (int j = 0; j < before->nvars; j++) {
+        const char *eq = strchr(before->vars[j], '=');
+        char *name = strndup(before->vars[j] + 1, eq - before->vars[j] - 1);
+        if (!var_get(name)) rc_put(f, 'u', name, strlen(name), "");
+        free(name);
+    }
+    for (int i = 0; i < alias_count; i++) {
+        int j = 0;
+        while (j < before->naliases && strcmp(before->aliases[j].name, aliases[i]->name) != 0) j++;
+        if (j == before->naliases || strcmp(before->aliases[j].value, aliases[i]->value) != 0)
+            rc_put(f, 'a', aliases[i]->name, strlen(aliases[i]->name), aliases[i]->value);
+    }
+    for (int j = 0; j < before->naliases; j++)
+        if (!alias_get(before->aliases[j].name))
+            rc_put(f, 'r', before->aliases[j].name, strlen(before->aliases[j].name), "");
+
+    if (fclose(f) != 0 || rename(tmp, snap) != 0) unlink(tmp);
+}
+
 /* ===== Load RC File ===== */
 void load_rc(void) {
     char rc_path[MAX_PATH];
-    const char *home = getenv("HOME");
+    const char *home = var_get("HOME");
     if (!home) return;
     snprintf(rc_path, sizeof(rc_path), "%s/%s", home, XSH_RC_FILE);
 
-    if (access(rc_path, R_OK) == 0) {
-        char *args[] = {"source", rc_path, NULL};
-        builtin_source(args, 2);
+    struct stat st;
+    if (access(rc_path, R_OK) != 0 || stat(rc_path, &st) != 0) return;
+
+    const char *opt = var_get("XSH_RC_CACHE");
+    char snap[MAX_PATH], key[MAX_PATH + 128];
+    int cache = !(opt && strcmp(opt, "0") == 0) &&
+                rc_snapshot_path(rc_path, snap, sizeof(snap)) == 0;
+    if (cache) {
+        rc_snapshot_key(rc_path, &st, key, sizeof(key));
+        if (rc_snapshot_load(snap, key)) return;
+    }
+
+    RcState before;
+    if (cache) rc_state_capture(&before);
+    rc_cacheable = 1;
+    char *args[] = {"source", rc_path, NULL};
+    builtin_source(args, 2);
+    if (cache) {
+        if (rc_cacheable) rc_snapshot_save(snap, key, &before);
+        else unlink(snap);
+        rc_state_free(&before);
     }
+    rc_cacheable = 0;
 }
 
 /* ===== Load/Save History ===== */
 void load_history_file(void) {
     char hist_path[MAX_PATH];
-    const char *home = getenv("HOME");
+    const char *home = var_get("HOME");
     if (!home) return;
     snprintf(hist_path, sizeof(hist_path), "%s/%s", home, XSH_HISTORY_FILE);
     history_load(hist_path);
@@ -1738,21 +6111,46 @@ void load_history_file(void) {
 
 void save_history_file(void) {
     char hist_path[MAX_PATH];
-    const char *home = getenv("HOME");
+    const char *home = var_get("HOME");
     if (!home) return;
     snprintf(hist_path, sizeof(hist_path), "%s/%s", home, XSH_HISTORY_FILE);
     history_save(hist_path);
 }
 
 /* ===== Main ===== */
+/*
+ * Read "> " continuation lines while the command is unfinished. Returns
+ * the whole text (malloc'd), or NULL if Ctrl-C abandoned it.
+ */
+static char *read_continuation(const char *first, int interactive) {
+    char *text = strdup(first);
+    while (text_incomplete(text)) {
+        char *more = xsh_readline(interactive ? "> " : "");
+        if (!more) break;   /* EOF: let the parser report it */
+        if (readline_cancelled) {
+            free(more);
+            free(text);
+            return NULL;
+        }
+        size_t tl = strlen(text);
+        text = realloc(text, tl + strlen(more) + 2);
+        text[tl] = '\n';
+        strcpy(text + tl + 1, more);
+        free(more);
+    }
+    return text;
+}
+
 int main(int argc, char *argv[]) {
     /* Initialize */
+    var_init();
     gethostname(hostname, sizeof(hostname));
     /* Remove domain from hostname */
     char *dot = strchr(hostname, '.');
     if (dot) *dot = '\0';
 
     user_info = getpwuid(getuid());
+    if (!getcwd(cwd, sizeof(cwd))) strcpy(cwd, "/");
 
     /* Setup signals */
     signal(SIGINT, sigint_handler);
@@ -1760,13 +6158,14 @@ int main(int argc, char *argv[]) {
     signal(SIGCHLD, sigchld_handler);
     signal(SIGTTOU, SIG_IGN);
     signal(SIGTTIN, SIG_IGN);
+    signal(SIGWINCH, sigwinch_handler);
 
     /* Set XSH as shell env — use argv[0] if available, otherwise a generic path */
     {
         const char *shell_path = (argc > 0 && argv[0][0] == '/') ? argv[0] : "xsh";
-        setenv("SHELL", shell_path, 0);
+        if (!var_get("SHELL")) var_set("SHELL", shell_path, VAR_EXPORT);
     }
-    setenv("XSH_VERSION", XSH_VERSION, 1);
+    var_set("XSH_VERSION", XSH_VERSION, VAR_EXPORT);
 
     /* Initialize readline */
     /* (using custom implementation) */
@@ -1785,8 +6184,8 @@ int main(int argc, char *argv[]) {
 
     /* Script mode */
     if (argc > 1) {
-        FILE *f = fopen(argv[1], "r");
-        if (!f) {
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
             fprintf(stderr, "xsh: %s: %s\n", argv[1], strerror(errno));
             return 1;
         }
@@ -1796,14 +6195,8 @@ int main(int argc, char *argv[]) {
             dup2(devnull, STDIN_FILENO);
             close(devnull);
         }
-        char line[MAX_CMD_LEN];
-        int ret = 0;
-        while (fgets(line, sizeof(line), f)) {
-            line[strcspn(line, "\n")] = '\0';
-            if (line[0] == '#' || line[0] == '\0') continue;
-            ret = execute_line(line);
-        }
-        fclose(f);
+        int ret = run_script(fd);
+        close(fd);
         return ret;
     }
 
@@ -1850,8 +6243,12 @@ int main(int argc, char *argv[]) {
         while (*trimmed == ' ' || *trimmed == '\t') trimmed++;
 
         if (*trimmed) {
-            history_add(trimmed);
-            last_exit_code = execute_line(trimmed);
+            char *text = read_continuation(trimmed, interactive);
+            if (text) {
+                history_add(text);
+                last_exit_code = execute_line(text);
+                free(text);
+            }
         }
 
         free(line);